@@ -0,0 +1,228 @@
+#pragma once
+//model checkpoint laid out so a memory mapping of the file can be used for inference as is:
+//a 64 byte header, then the weights (numClassify x featureDimension floats) and biases, each starting on a 64 byte boundary.
+//values are stored in host byte order, endianCheck tells a reader on the other byte order to refuse the file
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "gemm.h"
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+const uint32_t checkpoint_magic_number = 0x4B434E4D;//"MNCK"
+const uint32_t checkpoint_version = 1;
+const uint32_t checkpoint_endian_check = 0x01020304;
+const uint32_t checkpoint_alignment = 64;
+
+enum class CheckpointModel : uint32_t
+{
+	SigmoidRegression = 0,
+	SoftmaxRegression = 1,
+};
+
+struct CheckpointHeader
+{
+	uint32_t magicNumber;
+	uint32_t version;
+	uint32_t endianCheck;
+	CheckpointModel model;
+	uint32_t featureDimension;
+	uint32_t numClassify;
+	uint64_t weightsOffset;
+	uint64_t biasesOffset;
+	uint64_t fileSize;
+	uint32_t inputDimension;//raw pixels a projection maps to featureDimension before the model sees them, 0 when the model reads raw pixels
+	uint8_t reserved[12];
+};
+static_assert(sizeof(CheckpointHeader) == checkpoint_alignment, "checkpoint header must fill one alignment unit");
+
+inline uint64_t CheckpointAlign(uint64_t offset)
+{
+	return (offset + checkpoint_alignment - 1) / checkpoint_alignment * checkpoint_alignment;
+}
+
+inline bool WriteCheckpoint(const std::string& fileName, CheckpointModel model, uint32_t featureDimension, uint32_t numClassify,
+	const float* weights, const float* biases, uint32_t inputDimension = 0)
+{
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	CheckpointHeader header = {};
+	header.magicNumber = checkpoint_magic_number;
+	header.version = checkpoint_version;
+	header.endianCheck = checkpoint_endian_check;
+	header.model = model;
+	header.featureDimension = featureDimension;
+	header.numClassify = numClassify;
+	header.inputDimension = inputDimension;
+	header.weightsOffset = CheckpointAlign(sizeof(CheckpointHeader));
+	header.biasesOffset = CheckpointAlign(header.weightsOffset + uint64_t(featureDimension) * numClassify * sizeof(float));
+	header.fileSize = CheckpointAlign(header.biasesOffset + numClassify * sizeof(float));
+
+	std::vector<char> image(header.fileSize, 0);
+	memcpy(image.data(), &header, sizeof(header));
+	memcpy(image.data() + header.weightsOffset, weights, size_t(featureDimension) * numClassify * sizeof(float));
+	memcpy(image.data() + header.biasesOffset, biases, numClassify * sizeof(float));
+	file.write(image.data(), image.size());
+	return bool(file);
+}
+
+//predictions[b] = argmax over i of biases[i] + scale * features[b] . weights[i]; sigmoid and softmax keep the argmax of the logits
+inline void PredictBatch(const float* weights, const float* biases, uint32_t featureDimension, uint32_t numClassify,
+	const float* features, uint32_t count, uint8_t* predictions, float scale = 1.0f)
+{
+	thread_local std::vector<float> s_logits;
+	s_logits.resize(size_t(count) * numClassify);
+	for (uint32_t b = 0; b < count; ++b)
+	{
+		std::copy(biases, biases + numClassify, &s_logits[size_t(b) * numClassify]);
+	}
+	Gemm(false, true, count, numClassify, featureDimension, scale, features, featureDimension,
+		weights, featureDimension, 1.0f, s_logits.data(), numClassify);
+	for (uint32_t b = 0; b < count; ++b)
+	{
+		const float* z = &s_logits[size_t(b) * numClassify];
+		predictions[b] = uint8_t(std::max_element(z, z + numClassify) - z);
+	}
+}
+
+//raw pixels, scaled by 1 / 255 as in training
+inline void PredictBatch(const float* weights, const float* biases, uint32_t featureDimension, uint32_t numClassify,
+	const uint8_t* features, uint32_t count, uint8_t* predictions)
+{
+	thread_local std::vector<float> s_features;
+	s_features.resize(size_t(count) * featureDimension);
+	for (size_t i = 0; i < s_features.size(); ++i)
+	{
+		s_features[i] = features[i];
+	}
+	PredictBatch(weights, biases, featureDimension, numClassify, s_features.data(), count, predictions, 1.0f / 255.0f);
+}
+
+//read-only memory mapping of a checkpoint; weights() and biases() point straight into the mapped file
+class MappedCheckpoint
+{
+public:
+	MappedCheckpoint() :
+		m_data(nullptr),
+		m_size(0)
+	{}
+	~MappedCheckpoint()
+	{
+		close();
+	}
+	MappedCheckpoint(const MappedCheckpoint&) = delete;
+	MappedCheckpoint& operator=(const MappedCheckpoint&) = delete;
+public:
+	bool open(const std::string& fileName)
+	{
+		close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+		LARGE_INTEGER size;
+		HANDLE mapping = GetFileSizeEx(file, &size) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+		CloseHandle(file);
+		if (!mapping)
+		{
+			return false;
+		}
+		m_data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+		m_size = size_t(size.QuadPart);
+#else
+		int file = ::open(fileName.c_str(), O_RDONLY);
+		if (file < 0)
+		{
+			return false;
+		}
+		struct stat status;
+		if (fstat(file, &status) == 0 && status.st_size > 0)
+		{
+			void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, file, 0);
+			m_data = data == MAP_FAILED ? nullptr : (const uint8_t*)data;
+			m_size = status.st_size;
+		}
+		::close(file);
+#endif
+		if (!m_data || !valid())
+		{
+			close();
+			return false;
+		}
+		return true;
+	}
+	void close()
+	{
+		if (m_data)
+		{
+#ifdef _WIN32
+			UnmapViewOfFile(m_data);
+#else
+			munmap((void*)m_data, m_size);
+#endif
+		}
+		m_data = nullptr;
+		m_size = 0;
+	}
+	const CheckpointHeader& header() const
+	{
+		return *(const CheckpointHeader*)m_data;
+	}
+	const float* weights() const
+	{
+		return (const float*)(m_data + header().weightsOffset);
+	}
+	const float* biases() const
+	{
+		return (const float*)(m_data + header().biasesOffset);
+	}
+	//trained on projected features, predict(const uint8_t*) must not be fed raw pixels
+	bool projected() const
+	{
+		return header().inputDimension != 0;
+	}
+	void predict(const uint8_t* features, uint32_t count, uint8_t* predictions) const
+	{
+		PredictBatch(weights(), biases(), header().featureDimension, header().numClassify, features, count, predictions);
+	}
+	//features already projected, e.g. by a Projection loaded next to the checkpoint
+	void predict(const float* features, uint32_t count, uint8_t* predictions) const
+	{
+		PredictBatch(weights(), biases(), header().featureDimension, header().numClassify, features, count, predictions);
+	}
+private:
+	bool valid() const
+	{
+		if (m_size < sizeof(CheckpointHeader))
+		{
+			return false;
+		}
+		const CheckpointHeader& h = header();
+		uint64_t weightsSize = uint64_t(h.featureDimension) * h.numClassify * sizeof(float);
+		return h.magicNumber == checkpoint_magic_number && h.version == checkpoint_version && h.endianCheck == checkpoint_endian_check
+			&& h.fileSize <= m_size && h.weightsOffset % checkpoint_alignment == 0 && h.biasesOffset % checkpoint_alignment == 0
+			&& h.weightsOffset + weightsSize <= h.fileSize && h.biasesOffset + h.numClassify * sizeof(float) <= h.fileSize;
+	}
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+};
@@ -1,77 +1,11 @@
-﻿#include <fstream>
-#include <vector>
-
-const uint32_t mnist_image_header_flag = 0x00000803;
-const uint32_t mnist_label_header_flag = 0x00000801;
-
-struct MnistImageHeader
-{
-	uint32_t magicNumber;
-	uint32_t imageCount;
-	uint32_t rowCount;
-	uint32_t columnCount;
-};
-
-struct MnistLabelHeader
-{
-	uint32_t magicNumber;
-	uint32_t labelCount;
-};
-
-uint32_t ConvertEndian(uint32_t n)
-{
-	return ((n << 24) & 0xFF000000) | ((n << 8) & 0x00FF0000) | ((n >> 8) & 0x0000FF00) | ((n >> 24) & 0x000000FF);
-}
-
-bool ReadImageData(MnistImageHeader& header, std::vector<char>& data, const char* fileName)
-{
-	std::ifstream file(fileName, std::ios::binary);
-	if (!file.is_open())
-	{
-		return false;
-	}
-	uint32_t tmp;
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.magicNumber = ConvertEndian(tmp);
-	if (header.magicNumber != 0x00000803)
-	{
-		return false;
-	}
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.imageCount = ConvertEndian(tmp);
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.rowCount = ConvertEndian(tmp);
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.columnCount = ConvertEndian(tmp);
-
-	uint32_t dataSize = header.imageCount*header.rowCount*header.columnCount;
-	data.resize(dataSize);
-	file.read(data.data(), dataSize);
-	return true;
-}
-
-bool ReadLabelData(MnistLabelHeader& header, std::vector<char>& data, const char* fileName)
-{
-	std::ifstream file(fileName, std::ios::binary);
-	if (!file.is_open())
-	{
-		return false;
-	}
-	uint32_t tmp;
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.magicNumber = ConvertEndian(tmp);
-	if (header.magicNumber != 0x00000803)
-	{
-		return false;
-	}
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.labelCount = ConvertEndian(tmp);
-
-	uint32_t dataSize = header.labelCount;
-	data.resize(dataSize);
-	file.read(data.data(), dataSize);
-	return true;
-}
+﻿#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include "../mnist.h"
+#include "../optimizer.h"
+#include "../gemm.h"
+#include "../parallel.h"
 
 //class ActivationFunction
 //{
@@ -137,9 +71,8 @@ public:
 	LossFunction(uint32_t dimension)
 	{
 		m_dimension = dimension;
-		m_losses.resize(dimension);
-		m_derivates.resize(dimension);
 	}
+	virtual ~LossFunction() {}
 	uint32_t dimension() const
 	{
 		return m_dimension;
@@ -149,7 +82,8 @@ public:
 		return m_derivates.data();
 	}
 public:
-	virtual void forward(const float* yHat, const float* yLabel) = 0;
+	//yHat and yLabel hold batchSize rows of dimension values
+	virtual void forward(const float* yHat, const float* yLabel, uint32_t batchSize) = 0;
 protected:
 	uint32_t m_dimension;
 	std::vector<float> m_losses;
@@ -159,43 +93,41 @@ protected:
 class MeanSquareError : public LossFunction
 {
 public:
-	//float forward(float* y, float* yHat, uint32_t batch) override
-	//{
-	//	float totalLoss = 0;
-	//	for (uint32_t i = 0; i < batch; ++i)
-	//	{
-	//		float dis = y - yHat;
-	//		float loss = dis * dis;
-	//		totalLoss += loss;
-	//	}
-	//	float c = totalLoss / (2 * batch);
-	//	return c;
-	//}
-	virtual float derivate(float yHat, float yLabel) override
-	{
-		float res = 2.0*(yHat - yLabel);
-		return res;
+	MeanSquareError(uint32_t dimension) :
+		LossFunction(dimension)
+	{}
+public:
+	void forward(const float* yHat, const float* yLabel, uint32_t batchSize) override
+	{
+		uint32_t count = m_dimension * batchSize;
+		m_losses.resize(count);
+		m_derivates.resize(count);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			float dis = yHat[i] - yLabel[i];
+			m_losses[i] = dis * dis;
+			m_derivates[i] = 2.0f * dis;
+		}
 	}
-//public:
-//	static MeanSquareError* GetInstance()
-//	{
-//		static MeanSquareError s_instance;
-//		return &s_instance;
-//	}
 };
 
+//all layers work on a batch of samples stored back to back, numInputs (numOutputs) floats per sample
 class Layer
 {
 public:
 	Layer(uint32_t numInputs, uint32_t numOutputs) :
 		m_numInputs(numInputs),
 		m_numOutputs(numOutputs)
+	{}
+	virtual ~Layer() {}
+public:
+	virtual void forward(const float* inputs, uint32_t batchSize) = 0;
+	//inputs are the ones given to the last forward, outputDerivates is dLoss/dOutput
+	virtual void backward(const float* inputs, const float* outputDerivates, uint32_t batchSize) = 0;
+	//applies the derivates accumulated by backward, averaged over batchSize samples
+	virtual void update(Optimizer*, float, uint32_t)
 	{
-		m_features.resize(numOutputs);
 	}
-public:
-	virtual void forward(const float* inputs) = 0;
-	virtual void backward(const float* inputs) = 0;
 public:
 	uint32_t numInputs() const
 	{
@@ -209,10 +141,24 @@ public:
 	{
 		return m_features.data();
 	}
+	const float* inputDerivates() const
+	{
+		return m_inputDerivates.data();
+	}
+protected:
+	void resizeFeatures(uint32_t batchSize)
+	{
+		m_features.resize(size_t(m_numOutputs) * batchSize);
+	}
+	void resizeInputDerivates(uint32_t batchSize)
+	{
+		m_inputDerivates.resize(size_t(m_numInputs) * batchSize);
+	}
 protected:
 	uint32_t m_numInputs;
 	uint32_t m_numOutputs;
 	std::vector<float> m_features;
+	std::vector<float> m_inputDerivates;
 };
 
 class LinearLayer : public Layer
@@ -223,26 +169,417 @@ public:
 	{
 		m_weights.resize(numInputs * numOutputs);
 		m_biases.resize(numOutputs);
+		m_sumWeightDerivates.resize(numInputs * numOutputs);
+		m_sumBiasDerivates.resize(numOutputs);
+		float range = sqrt(6.0f / (numInputs + numOutputs));
+		for (auto& weight : m_weights)
+		{
+			weight = (rand() / float(RAND_MAX) * 2.0f - 1.0f) * range;
+		}
 	}
 public:
-	void forward(const float* inputs) override
+	//features[b][n] = biases[n] + inputs[b][:] . weights[n][:]
+	void forward(const float* inputs, uint32_t batchSize) override
 	{
-		for (uint32_t n = 0; n < m_numOutputs; ++n)
+		resizeFeatures(batchSize);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
 		{
-			m_features[n] = m_biases[n];
-			float* weights = m_weights.data() + m_numInputs * n;
-			for (uint32_t i = 0; i < m_numInputs; ++i)
+			float* features = &m_features[size_t(begin) * m_numOutputs];
+			for (uint32_t b = begin; b < end; ++b)
 			{
-				m_features[n] += inputs[i] * weights[i];
+				std::copy(m_biases.begin(), m_biases.end(), &m_features[size_t(b) * m_numOutputs]);
+			}
+			Gemm(false, true, end - begin, m_numOutputs, m_numInputs, 1.0f, inputs + size_t(begin) * m_numInputs, m_numInputs,
+				m_weights.data(), m_numInputs, 1.0f, features, m_numOutputs);
+		}, 16);
+	}
+	void backward(const float* inputs, const float* outputDerivates, uint32_t batchSize) override
+	{
+		resizeInputDerivates(batchSize);
+		//each band of output rows owns its weight and bias derivates, so the bands accumulate without synchronisation
+		ParallelFor(m_numOutputs, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			Gemm(true, false, end - begin, m_numInputs, batchSize, 1.0f, outputDerivates + begin, m_numOutputs,
+				inputs, m_numInputs, 1.0f, &m_sumWeightDerivates[size_t(begin) * m_numInputs], m_numInputs);
+			for (uint32_t b = 0; b < batchSize; ++b)
+			{
+				for (uint32_t n = begin; n < end; ++n)
+				{
+					m_sumBiasDerivates[n] += outputDerivates[size_t(b) * m_numOutputs + n];
+				}
+			}
+		}, 8);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			Gemm(false, false, end - begin, m_numInputs, m_numOutputs, 1.0f, outputDerivates + size_t(begin) * m_numOutputs, m_numOutputs,
+				m_weights.data(), m_numInputs, 0.0f, &m_inputDerivates[size_t(begin) * m_numInputs], m_numInputs);
+		}, 16);
+	}
+	void update(Optimizer* optimizer, float learningRate, uint32_t batchSize) override
+	{
+		float gradScale = 1.0f / batchSize;
+		optimizer->update(m_weights.data(), m_sumWeightDerivates.data(), m_weightState, m_weights.size(), gradScale, learningRate);
+		optimizer->update(m_biases.data(), m_sumBiasDerivates.data(), m_biasState, m_biases.size(), gradScale, learningRate);
+		std::fill(m_sumWeightDerivates.begin(), m_sumWeightDerivates.end(), 0.0f);
+		std::fill(m_sumBiasDerivates.begin(), m_sumBiasDerivates.end(), 0.0f);
+	}
+private:
+	std::vector<float> m_weights;
+	std::vector<float> m_biases;
+	std::vector<float> m_sumWeightDerivates;
+	std::vector<float> m_sumBiasDerivates;
+	OptimizerState m_weightState;
+	OptimizerState m_biasState;
+};
+
+//cols[(c * kernelSize + ky) * kernelSize + kx][oy * outWidth + ox] = input[c][oy * stride + ky - padding][ox * stride + kx - padding], zero outside
+inline void Im2Col(const float* input, uint32_t channels, uint32_t height, uint32_t width,
+	uint32_t kernelSize, uint32_t padding, uint32_t stride, uint32_t outHeight, uint32_t outWidth, float* cols)
+{
+	for (uint32_t c = 0; c < channels; ++c)
+	{
+		const float* plane = input + size_t(c) * height * width;
+		for (uint32_t ky = 0; ky < kernelSize; ++ky)
+		{
+			for (uint32_t kx = 0; kx < kernelSize; ++kx)
+			{
+				for (uint32_t oy = 0; oy < outHeight; ++oy)
+				{
+					int32_t iy = int32_t(oy * stride + ky) - int32_t(padding);
+					for (uint32_t ox = 0; ox < outWidth; ++ox)
+					{
+						int32_t ix = int32_t(ox * stride + kx) - int32_t(padding);
+						bool inside = iy >= 0 && iy < int32_t(height) && ix >= 0 && ix < int32_t(width);
+						*cols++ = inside ? plane[iy * width + ix] : 0.0f;
+					}
+				}
 			}
 		}
 	}
+}
+
+//inverse scatter of Im2Col, accumulating into input which the caller clears
+inline void Col2Im(const float* cols, uint32_t channels, uint32_t height, uint32_t width,
+	uint32_t kernelSize, uint32_t padding, uint32_t stride, uint32_t outHeight, uint32_t outWidth, float* input)
+{
+	for (uint32_t c = 0; c < channels; ++c)
+	{
+		float* plane = input + size_t(c) * height * width;
+		for (uint32_t ky = 0; ky < kernelSize; ++ky)
+		{
+			for (uint32_t kx = 0; kx < kernelSize; ++kx)
+			{
+				for (uint32_t oy = 0; oy < outHeight; ++oy)
+				{
+					int32_t iy = int32_t(oy * stride + ky) - int32_t(padding);
+					for (uint32_t ox = 0; ox < outWidth; ++ox, ++cols)
+					{
+						int32_t ix = int32_t(ox * stride + kx) - int32_t(padding);
+						if (iy >= 0 && iy < int32_t(height) && ix >= 0 && ix < int32_t(width))
+						{
+							plane[iy * width + ix] += *cols;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+//input is channels x height x width per sample, output is outChannels x outHeight x outWidth
+class Conv2DLayer : public Layer
+{
+public:
+	Conv2DLayer(uint32_t channels, uint32_t height, uint32_t width, uint32_t outChannels, uint32_t kernelSize, uint32_t padding = 0, uint32_t stride = 1) :
+		Layer(channels * height * width, outChannels * OutSize(height, kernelSize, padding, stride) * OutSize(width, kernelSize, padding, stride)),
+		m_channels(channels),
+		m_height(height),
+		m_width(width),
+		m_outChannels(outChannels),
+		m_kernelSize(kernelSize),
+		m_padding(padding),
+		m_stride(stride),
+		m_outHeight(OutSize(height, kernelSize, padding, stride)),
+		m_outWidth(OutSize(width, kernelSize, padding, stride))
+	{
+		uint32_t numWeights = outChannels * colRows();
+		m_weights.resize(numWeights);
+		m_biases.resize(outChannels);
+		m_sumWeightDerivates.resize(numWeights);
+		m_sumBiasDerivates.resize(outChannels);
+		float range = sqrt(6.0f / (colRows() + outChannels * kernelSize * kernelSize));
+		for (auto& weight : m_weights)
+		{
+			weight = (rand() / float(RAND_MAX) * 2.0f - 1.0f) * range;
+		}
+		uint32_t numThreads = ParallelThreadCount();
+		m_cols.resize(numThreads);
+		m_colDerivates.resize(numThreads);
+		m_threadWeightDerivates.resize(numThreads);
+		m_threadBiasDerivates.resize(numThreads);
+	}
+public:
+	static uint32_t OutSize(uint32_t size, uint32_t kernelSize, uint32_t padding, uint32_t stride)
+	{
+		return (size + 2 * padding - kernelSize) / stride + 1;
+	}
+	uint32_t outChannels() const
+	{
+		return m_outChannels;
+	}
+	uint32_t outHeight() const
+	{
+		return m_outHeight;
+	}
+	uint32_t outWidth() const
+	{
+		return m_outWidth;
+	}
+public:
+	void forward(const float* inputs, uint32_t batchSize) override
+	{
+		resizeFeatures(batchSize);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t thread)
+		{
+			for (uint32_t b = begin; b < end; ++b)
+			{
+				const float* input = inputs + size_t(b) * m_numInputs;
+				float* output = &m_features[size_t(b) * m_numOutputs];
+				if (m_stride == 1 && m_kernelSize == 3)
+				{
+					forwardDirect<3>(input, output);
+				}
+				else if (m_stride == 1 && m_kernelSize == 5)
+				{
+					forwardDirect<5>(input, output);
+				}
+				else
+				{
+					forwardIm2Col(input, output, thread);
+				}
+			}
+		});
+	}
+	void backward(const float* inputs, const float* outputDerivates, uint32_t batchSize) override
+	{
+		resizeInputDerivates(batchSize);
+		uint32_t outSize = m_outHeight * m_outWidth;
+		for (uint32_t t = 0; t < ParallelThreadCount(); ++t)
+		{
+			m_threadWeightDerivates[t].assign(m_weights.size(), 0.0f);
+			m_threadBiasDerivates[t].assign(m_biases.size(), 0.0f);
+		}
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t thread)
+		{
+			std::vector<float>& cols = m_cols[thread];
+			std::vector<float>& colDerivates = m_colDerivates[thread];
+			cols.resize(size_t(colRows()) * outSize);
+			colDerivates.resize(size_t(colRows()) * outSize);
+			for (uint32_t b = begin; b < end; ++b)
+			{
+				const float* input = inputs + size_t(b) * m_numInputs;
+				const float* outputDerivate = outputDerivates + size_t(b) * m_numOutputs;
+				float* inputDerivate = &m_inputDerivates[size_t(b) * m_numInputs];
+				Im2Col(input, m_channels, m_height, m_width, m_kernelSize, m_padding, m_stride, m_outHeight, m_outWidth, cols.data());
+				Gemm(false, true, m_outChannels, colRows(), outSize, 1.0f, outputDerivate, outSize,
+					cols.data(), outSize, 1.0f, m_threadWeightDerivates[thread].data(), colRows());
+				for (uint32_t oc = 0; oc < m_outChannels; ++oc)
+				{
+					const float* plane = outputDerivate + size_t(oc) * outSize;
+					m_threadBiasDerivates[thread][oc] += std::accumulate(plane, plane + outSize, 0.0f);
+				}
+				Gemm(true, false, colRows(), outSize, m_outChannels, 1.0f, m_weights.data(), colRows(),
+					outputDerivate, outSize, 0.0f, colDerivates.data(), outSize);
+				std::fill(inputDerivate, inputDerivate + m_numInputs, 0.0f);
+				Col2Im(colDerivates.data(), m_channels, m_height, m_width, m_kernelSize, m_padding, m_stride, m_outHeight, m_outWidth, inputDerivate);
+			}
+		});
+		for (uint32_t t = 0; t < ParallelThreadCount(); ++t)
+		{
+			for (size_t i = 0; i < m_weights.size(); ++i)
+			{
+				m_sumWeightDerivates[i] += m_threadWeightDerivates[t][i];
+			}
+			for (size_t i = 0; i < m_biases.size(); ++i)
+			{
+				m_sumBiasDerivates[i] += m_threadBiasDerivates[t][i];
+			}
+		}
+	}
+	void update(Optimizer* optimizer, float learningRate, uint32_t batchSize) override
+	{
+		float gradScale = 1.0f / batchSize;
+		optimizer->update(m_weights.data(), m_sumWeightDerivates.data(), m_weightState, m_weights.size(), gradScale, learningRate);
+		optimizer->update(m_biases.data(), m_sumBiasDerivates.data(), m_biasState, m_biases.size(), gradScale, learningRate);
+		std::fill(m_sumWeightDerivates.begin(), m_sumWeightDerivates.end(), 0.0f);
+		std::fill(m_sumBiasDerivates.begin(), m_sumBiasDerivates.end(), 0.0f);
+	}
 private:
+	uint32_t colRows() const
+	{
+		return m_channels * m_kernelSize * m_kernelSize;
+	}
+	void forwardIm2Col(const float* input, float* output, uint32_t thread)
+	{
+		uint32_t outSize = m_outHeight * m_outWidth;
+		std::vector<float>& cols = m_cols[thread];
+		cols.resize(size_t(colRows()) * outSize);
+		Im2Col(input, m_channels, m_height, m_width, m_kernelSize, m_padding, m_stride, m_outHeight, m_outWidth, cols.data());
+		for (uint32_t oc = 0; oc < m_outChannels; ++oc)
+		{
+			std::fill(output + size_t(oc) * outSize, output + size_t(oc + 1) * outSize, m_biases[oc]);
+		}
+		Gemm(false, false, m_outChannels, outSize, colRows(), 1.0f, m_weights.data(), colRows(), cols.data(), outSize, 1.0f, output, outSize);
+	}
+	//stride 1 only: every weight is applied to a contiguous run of each input row, which the compiler vectorizes
+	template<uint32_t kernelSize>
+	void forwardDirect(const float* input, float* output)
+	{
+		uint32_t outSize = m_outHeight * m_outWidth;
+		int32_t padding = m_padding;
+		for (uint32_t oc = 0; oc < m_outChannels; ++oc)
+		{
+			float* outPlane = output + size_t(oc) * outSize;
+			std::fill(outPlane, outPlane + outSize, m_biases[oc]);
+			for (uint32_t c = 0; c < m_channels; ++c)
+			{
+				const float* plane = input + size_t(c) * m_height * m_width;
+				const float* weights = &m_weights[(size_t(oc) * m_channels + c) * kernelSize * kernelSize];
+				for (uint32_t ky = 0; ky < kernelSize; ++ky)
+				{
+					for (uint32_t kx = 0; kx < kernelSize; ++kx)
+					{
+						float weight = weights[ky * kernelSize + kx];
+						int32_t shift = int32_t(kx) - padding;
+						uint32_t oxBegin = uint32_t(std::max(0, -shift));
+						uint32_t oxEnd = uint32_t(std::max(0, std::min(int32_t(m_outWidth), int32_t(m_width) - shift)));
+						for (uint32_t oy = 0; oy < m_outHeight; ++oy)
+						{
+							int32_t iy = int32_t(oy + ky) - padding;
+							if (iy < 0 || iy >= int32_t(m_height))
+							{
+								continue;
+							}
+							//both rows start at oxBegin, so the input offset iy * width + oxBegin + shift is never negative
+							const float* MNIST_RESTRICT inRow = plane + (iy * int32_t(m_width) + int32_t(oxBegin) + shift);
+							float* MNIST_RESTRICT outRow = outPlane + oy * m_outWidth + oxBegin;
+							for (uint32_t ox = 0; ox + oxBegin < oxEnd; ++ox)
+							{
+								outRow[ox] += weight * inRow[ox];
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+private:
+	uint32_t m_channels;
+	uint32_t m_height;
+	uint32_t m_width;
+	uint32_t m_outChannels;
+	uint32_t m_kernelSize;
+	uint32_t m_padding;
+	uint32_t m_stride;
+	uint32_t m_outHeight;
+	uint32_t m_outWidth;
 	std::vector<float> m_weights;
 	std::vector<float> m_biases;
-	//std::vector<float> m_weightDerivates;
-	//std::vector<float> m_biasDerivates;
+	std::vector<float> m_sumWeightDerivates;
+	std::vector<float> m_sumBiasDerivates;
+	OptimizerState m_weightState;
+	OptimizerState m_biasState;
+	//per-thread workspaces, reused across batches
+	std::vector<std::vector<float>> m_cols;
+	std::vector<std::vector<float>> m_colDerivates;
+	std::vector<std::vector<float>> m_threadWeightDerivates;
+	std::vector<std::vector<float>> m_threadBiasDerivates;
+};
+
+//non-overlapping poolSize x poolSize max pooling, input is channels x height x width per sample
+class MaxPool2DLayer : public Layer
+{
+public:
+	MaxPool2DLayer(uint32_t channels, uint32_t height, uint32_t width, uint32_t poolSize = 2) :
+		Layer(channels * height * width, channels * (height / poolSize) * (width / poolSize)),
+		m_channels(channels),
+		m_height(height),
+		m_width(width),
+		m_poolSize(poolSize),
+		m_outHeight(height / poolSize),
+		m_outWidth(width / poolSize)
+	{}
 public:
+	uint32_t outHeight() const
+	{
+		return m_outHeight;
+	}
+	uint32_t outWidth() const
+	{
+		return m_outWidth;
+	}
+public:
+	void forward(const float* inputs, uint32_t batchSize) override
+	{
+		resizeFeatures(batchSize);
+		m_maxIndices.resize(size_t(m_numOutputs) * batchSize);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			for (uint32_t b = begin; b < end; ++b)
+			{
+				const float* input = inputs + size_t(b) * m_numInputs;
+				float* output = &m_features[size_t(b) * m_numOutputs];
+				uint32_t* maxIndices = &m_maxIndices[size_t(b) * m_numOutputs];
+				for (uint32_t c = 0; c < m_channels; ++c)
+				{
+					for (uint32_t oy = 0; oy < m_outHeight; ++oy)
+					{
+						for (uint32_t ox = 0; ox < m_outWidth; ++ox)
+						{
+							uint32_t maxIndex = (c * m_height + oy * m_poolSize) * m_width + ox * m_poolSize;
+							for (uint32_t py = 0; py < m_poolSize; ++py)
+							{
+								for (uint32_t px = 0; px < m_poolSize; ++px)
+								{
+									uint32_t index = (c * m_height + oy * m_poolSize + py) * m_width + ox * m_poolSize + px;
+									if (input[index] > input[maxIndex])
+									{
+										maxIndex = index;
+									}
+								}
+							}
+							*output++ = input[maxIndex];
+							*maxIndices++ = maxIndex;
+						}
+					}
+				}
+			}
+		});
+	}
+	void backward(const float*, const float* outputDerivates, uint32_t batchSize) override
+	{
+		resizeInputDerivates(batchSize);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			for (uint32_t b = begin; b < end; ++b)
+			{
+				float* inputDerivate = &m_inputDerivates[size_t(b) * m_numInputs];
+				std::fill(inputDerivate, inputDerivate + m_numInputs, 0.0f);
+				for (uint32_t i = 0; i < m_numOutputs; ++i)
+				{
+					inputDerivate[m_maxIndices[size_t(b) * m_numOutputs + i]] += outputDerivates[size_t(b) * m_numOutputs + i];
+				}
+			}
+		});
+	}
+private:
+	uint32_t m_channels;
+	uint32_t m_height;
+	uint32_t m_width;
+	uint32_t m_poolSize;
+	uint32_t m_outHeight;
+	uint32_t m_outWidth;
+	std::vector<uint32_t> m_maxIndices;
 };
 
 class ActivationLayer : public Layer
@@ -250,8 +587,18 @@ class ActivationLayer : public Layer
 public:
 	ActivationLayer(uint32_t numInputs) :
 		Layer(numInputs, numInputs)
+	{}
+public:
+	void backward(const float*, const float* outputDerivates, uint32_t batchSize) override
 	{
-		m_derivates.resize(numInputs);
+		resizeInputDerivates(batchSize);
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			for (size_t i = size_t(begin) * m_numInputs; i < size_t(end) * m_numInputs; ++i)
+			{
+				m_inputDerivates[i] = outputDerivates[i] * m_derivates[i];
+			}
+		}, 16);
 	}
 protected:
 	std::vector<float> m_derivates;
@@ -264,63 +611,196 @@ public:
 		ActivationLayer(numInputs)
 	{}
 public:
-	void forward(const float* inputs) override
+	void forward(const float* inputs, uint32_t batchSize) override
 	{
-		for (uint32_t i = 0; i < m_numOutputs; ++i)
+		resizeFeatures(batchSize);
+		m_derivates.resize(m_features.size());
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
 		{
-			float sigma = 1.0 / (1.0 + exp(-inputs[i]));
-			m_features[i] = sigma;
-			m_derivates[i] = sigma * (1.0 - sigma);
-		}
+			for (size_t i = size_t(begin) * m_numInputs; i < size_t(end) * m_numInputs; ++i)
+			{
+				float sigma = 1.0 / (1.0 + exp(-inputs[i]));
+				m_features[i] = sigma;
+				m_derivates[i] = sigma * (1.0 - sigma);
+			}
+		}, 16);
 	}
-	void backward(const float* inputs) override
+};
+
+class ReLULayer : public ActivationLayer
+{
+public:
+	ReLULayer(uint32_t numInputs) :
+		ActivationLayer(numInputs)
+	{}
+public:
+	void forward(const float* inputs, uint32_t batchSize) override
 	{
+		resizeFeatures(batchSize);
+		m_derivates.resize(m_features.size());
+		ParallelFor(batchSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			for (size_t i = size_t(begin) * m_numInputs; i < size_t(end) * m_numInputs; ++i)
+			{
+				bool positive = inputs[i] > 0.0f;
+				m_features[i] = positive ? inputs[i] : 0.0f;
+				m_derivates[i] = positive ? 1.0f : 0.0f;
+			}
+		}, 16);
 	}
 };
 
 class FNN
 {
 public:
+	FNN(Optimizer* optimizer = SgdOptimizer::GetInstance()) :
+		m_loss(nullptr),
+		m_optimizer(optimizer)
+	{}
+	~FNN()
+	{
+		for (Layer* layer : m_layers)
+		{
+			delete layer;
+		}
+		delete m_loss;
+	}
+public:
+	void addLayer(Layer* layer)
+	{
+		m_layers.push_back(layer);
+	}
+	void setLoss(LossFunction* loss)
+	{
+		delete m_loss;
+		m_loss = loss;
+	}
 	void batch(float const* features, float  const* labels, uint32_t batchSize, float learningRate)
 	{
-		Layer* inputLayer = m_layers.front();
-		uint32_t numInputs = inputLayer->numInputs();
-		Layer* outputLayer = m_layers.back();
-		uint32_t numOutputs = outputLayer->numOutputs();
-
-		for (uint32_t i = 0; i < batchSize; ++i)
+		float const* outputs = forward(features, batchSize);
+		m_loss->forward(outputs, labels, batchSize);
+		float const* derivates = m_loss->derivates();
+		for (size_t l = m_layers.size(); l-- > 0;)
 		{
-			float const* inputs = &features[i*numInputs];
-			for (Layer* layer : m_layers)
-			{
-				layer->forward(inputs);
-				inputs = layer->outputFeatures();
-			}
-			m_loss->forward(inputs, &labels[numOutputs*i]);
-			for (auto it = m_layers.rbegin(); it != m_layers.rend(); ++it)
-			{
-				(*it)->backward();
-			}
+			float const* inputs = l > 0 ? m_layers[l - 1]->outputFeatures() : features;
+			m_layers[l]->backward(inputs, derivates, batchSize);
+			derivates = m_layers[l]->inputDerivates();
 		}
 		for (Layer* layer : m_layers)
 		{
-			layer->update(learningRate);
+			layer->update(m_optimizer, learningRate, batchSize);
 		}
 	}
-private:
-
+	float const* forward(float const* features, uint32_t batchSize)
+	{
+		float const* inputs = features;
+		for (Layer* layer : m_layers)
+		{
+			layer->forward(inputs, batchSize);
+			inputs = layer->outputFeatures();
+		}
+		return inputs;
+	}
+	float test(float const* features, const uint8_t* labels, uint32_t count, uint32_t batchSize = 256)
+	{
+		uint32_t numInputs = m_layers.front()->numInputs();
+		uint32_t numOutputs = m_layers.back()->numOutputs();
+		uint32_t errorCount = 0;
+		for (uint32_t begin = 0; begin < count; begin += batchSize)
+		{
+			uint32_t size = std::min(batchSize, count - begin);
+			float const* outputs = forward(&features[size_t(begin) * numInputs], size);
+			for (uint32_t i = 0; i < size; ++i)
+			{
+				float const* yHats = outputs + size_t(i) * numOutputs;
+				if (std::max_element(yHats, yHats + numOutputs) - yHats != labels[begin + i])
+				{
+					++errorCount;
+				}
+			}
+		}
+		return float(errorCount) / float(count);
+	}
 private:
 	std::vector<Layer*> m_layers;
 	LossFunction* m_loss;
+	Optimizer* m_optimizer;
 };
 
-void mnist2bmp()
-{
-}
-
 int main()
 {
 	std::string path = CMAKE_SOURCE_DIR;
-	mnist2bmp(path + "/data/train-images.bmp", path + "/data/train-images.idx3-ubyte");
-	mnist2bmp(path + "/data/t10k-images.bmp", path + "/data/t10k-images.idx3-ubyte");
+
+	MnistImageHeader trainImageHeader;
+	MnistLabelHeader trainLabelHeader;
+	MnistImageHeader testImageHeader;
+	MnistLabelHeader testLabelHeader;
+	std::vector<uint8_t> trainImages;
+	std::vector<uint8_t> trainLabels;
+	std::vector<uint8_t> testImages;
+	std::vector<uint8_t> testLabels;
+	bool b1 = ReadImageData(trainImageHeader, trainImages, path + "/data/train-images.idx3-ubyte");
+	bool b2 = ReadLabelData(trainLabelHeader, trainLabels, path + "/data/train-labels.idx1-ubyte");
+	bool b3 = ReadImageData(testImageHeader, testImages, path + "/data/t10k-images.idx3-ubyte");
+	bool b4 = ReadLabelData(testLabelHeader, testLabels, path + "/data/t10k-labels.idx1-ubyte");
+	if (!(b1 && b2 && b3 && b4))
+	{
+		return 0;
+	}
+
+	uint32_t featureDimension = trainImageHeader.columnCount * trainImageHeader.rowCount;
+	uint32_t numClassify = 10;
+	uint32_t validationCount = trainImageHeader.imageCount / 10;
+	uint32_t trainCount = trainImageHeader.imageCount - validationCount;
+	uint32_t testCount = testImageHeader.imageCount;
+
+	//the float features are read by every worker of the batched layers, so they are interleaved over the numa nodes
+	NumaBuffer<float> trainFeatures(NumaPlacement::Interleave);
+	NumaBuffer<float> testFeatures(NumaPlacement::Interleave);
+	{
+		std::vector<float> features(trainImages.size());
+		std::transform(trainImages.begin(), trainImages.end(), features.begin(), [](uint8_t x) { return x / 255.0f; });
+		trainFeatures.assign(features.data(), features.size());
+		features.resize(testImages.size());
+		std::transform(testImages.begin(), testImages.end(), features.begin(), [](uint8_t x) { return x / 255.0f; });
+		testFeatures.assign(features.data(), features.size());
+	}
+	std::vector<float> trainOneHots(trainLabels.size() * numClassify);
+	for (size_t i = 0; i < trainLabels.size(); ++i)
+	{
+		trainOneHots[i * numClassify + trainLabels[i]] = 1.0f;
+	}
+
+	AdamOptimizer optimizer;
+	FNN fnn(&optimizer);
+	Conv2DLayer* conv1 = new Conv2DLayer(1, trainImageHeader.rowCount, trainImageHeader.columnCount, 8, 5, 2);
+	fnn.addLayer(conv1);
+	fnn.addLayer(new ReLULayer(conv1->numOutputs()));
+	MaxPool2DLayer* pool1 = new MaxPool2DLayer(conv1->outChannels(), conv1->outHeight(), conv1->outWidth());
+	fnn.addLayer(pool1);
+	Conv2DLayer* conv2 = new Conv2DLayer(conv1->outChannels(), pool1->outHeight(), pool1->outWidth(), 16, 3, 1);
+	fnn.addLayer(conv2);
+	fnn.addLayer(new ReLULayer(conv2->numOutputs()));
+	MaxPool2DLayer* pool2 = new MaxPool2DLayer(conv2->outChannels(), conv2->outHeight(), conv2->outWidth());
+	fnn.addLayer(pool2);
+	fnn.addLayer(new LinearLayer(pool2->numOutputs(), numClassify));
+	fnn.addLayer(new SigmoidLayer(numClassify));
+	fnn.setLoss(new MeanSquareError(numClassify));
+
+	uint32_t batchSize = 32;
+	uint32_t numBatch = trainCount / batchSize;
+	float eta = 0.001;
+	uint32_t epoch = 10;
+
+	for (uint32_t e = 0; e < epoch; ++e)
+	{
+		for (uint32_t b = 0; b < numBatch; ++b)
+		{
+			fnn.batch(trainFeatures.data() + b * batchSize * featureDimension, trainOneHots.data() + b * batchSize * numClassify, batchSize, eta);
+		}
+		printf("%d: error %f, %f, %f\n", e + 1,
+			fnn.test(trainFeatures.data(), trainLabels.data(), trainCount) * 100,
+			fnn.test(trainFeatures.data() + trainCount * featureDimension, trainLabels.data() + trainCount, validationCount) * 100,
+			fnn.test(testFeatures.data(), testLabels.data(), testCount) * 100);
+	}
 }
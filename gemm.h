@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+#include "simd.h"
+
+//blocking sizes: a packed kc x nr panel of B and mc x kc block of A stay in L1/L2 while the micro kernel runs
+const uint32_t gemm_mr = 4;
+const uint32_t gemm_nr = 8;
+const uint32_t gemm_mc = 128;
+const uint32_t gemm_kc = 256;
+const uint32_t gemm_nc = 1024;
+
+//packs alpha * op(A)[i0 : i0 + mc, k0 : k0 + kc] into row panels of gemm_mr, zero padded
+inline void GemmPackA(bool transA, const float* A, uint32_t lda, uint32_t i0, uint32_t mc, uint32_t k0, uint32_t kc, float alpha, float* packed)
+{
+	for (uint32_t p = 0; p < mc; p += gemm_mr)
+	{
+		for (uint32_t k = 0; k < kc; ++k)
+		{
+			for (uint32_t r = 0; r < gemm_mr; ++r)
+			{
+				uint32_t i = i0 + p + r;
+				*packed++ = p + r < mc ? alpha * (transA ? A[size_t(k0 + k) * lda + i] : A[size_t(i) * lda + k0 + k]) : 0.0f;
+			}
+		}
+	}
+}
+
+//packs op(B)[k0 : k0 + kc, j0 : j0 + nc] into column panels of gemm_nr, zero padded
+inline void GemmPackB(bool transB, const float* B, uint32_t ldb, uint32_t k0, uint32_t kc, uint32_t j0, uint32_t nc, float* packed)
+{
+	for (uint32_t q = 0; q < nc; q += gemm_nr)
+	{
+		for (uint32_t k = 0; k < kc; ++k)
+		{
+			for (uint32_t c = 0; c < gemm_nr; ++c)
+			{
+				uint32_t j = j0 + q + c;
+				*packed++ = q + c < nc ? (transB ? B[size_t(j) * ldb + k0 + k] : B[size_t(k0 + k) * ldb + j]) : 0.0f;
+			}
+		}
+	}
+}
+
+//C[mr x nr] += a[kc x gemm_mr]^T * b[kc x gemm_nr]
+inline void GemmMicroKernel(uint32_t kc, const float* MNIST_RESTRICT a, const float* MNIST_RESTRICT b, float* C, uint32_t ldc, uint32_t mr, uint32_t nr)
+{
+	float tile[gemm_mr][gemm_nr];
+#if MNIST_SSE2
+	__m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps();
+	__m128 c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+	__m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps();
+	__m128 c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+	for (uint32_t k = 0; k < kc; ++k, a += gemm_mr, b += gemm_nr)
+	{
+		__m128 b0 = _mm_loadu_ps(b);
+		__m128 b1 = _mm_loadu_ps(b + 4);
+		__m128 a0 = _mm_set1_ps(a[0]);
+		__m128 a1 = _mm_set1_ps(a[1]);
+		__m128 a2 = _mm_set1_ps(a[2]);
+		__m128 a3 = _mm_set1_ps(a[3]);
+		c00 = _mm_add_ps(c00, _mm_mul_ps(a0, b0));
+		c01 = _mm_add_ps(c01, _mm_mul_ps(a0, b1));
+		c10 = _mm_add_ps(c10, _mm_mul_ps(a1, b0));
+		c11 = _mm_add_ps(c11, _mm_mul_ps(a1, b1));
+		c20 = _mm_add_ps(c20, _mm_mul_ps(a2, b0));
+		c21 = _mm_add_ps(c21, _mm_mul_ps(a2, b1));
+		c30 = _mm_add_ps(c30, _mm_mul_ps(a3, b0));
+		c31 = _mm_add_ps(c31, _mm_mul_ps(a3, b1));
+	}
+	if (mr == gemm_mr && nr == gemm_nr)
+	{
+		_mm_storeu_ps(C, _mm_add_ps(_mm_loadu_ps(C), c00));
+		_mm_storeu_ps(C + 4, _mm_add_ps(_mm_loadu_ps(C + 4), c01));
+		C += ldc;
+		_mm_storeu_ps(C, _mm_add_ps(_mm_loadu_ps(C), c10));
+		_mm_storeu_ps(C + 4, _mm_add_ps(_mm_loadu_ps(C + 4), c11));
+		C += ldc;
+		_mm_storeu_ps(C, _mm_add_ps(_mm_loadu_ps(C), c20));
+		_mm_storeu_ps(C + 4, _mm_add_ps(_mm_loadu_ps(C + 4), c21));
+		C += ldc;
+		_mm_storeu_ps(C, _mm_add_ps(_mm_loadu_ps(C), c30));
+		_mm_storeu_ps(C + 4, _mm_add_ps(_mm_loadu_ps(C + 4), c31));
+		return;
+	}
+	_mm_storeu_ps(tile[0], c00);
+	_mm_storeu_ps(tile[0] + 4, c01);
+	_mm_storeu_ps(tile[1], c10);
+	_mm_storeu_ps(tile[1] + 4, c11);
+	_mm_storeu_ps(tile[2], c20);
+	_mm_storeu_ps(tile[2] + 4, c21);
+	_mm_storeu_ps(tile[3], c30);
+	_mm_storeu_ps(tile[3] + 4, c31);
+#else
+	for (uint32_t r = 0; r < gemm_mr; ++r)
+	{
+		for (uint32_t c = 0; c < gemm_nr; ++c)
+		{
+			tile[r][c] = 0;
+		}
+	}
+	for (uint32_t k = 0; k < kc; ++k, a += gemm_mr, b += gemm_nr)
+	{
+		for (uint32_t r = 0; r < gemm_mr; ++r)
+		{
+			for (uint32_t c = 0; c < gemm_nr; ++c)
+			{
+				tile[r][c] += a[r] * b[c];
+			}
+		}
+	}
+#endif
+	for (uint32_t r = 0; r < mr; ++r)
+	{
+		for (uint32_t c = 0; c < nr; ++c)
+		{
+			C[size_t(r) * ldc + c] += tile[r][c];
+		}
+	}
+}
+
+//row-major C[M x N] = alpha * op(A)[M x K] * op(B)[K x N] + beta * C, op transposes when trans is set
+inline void Gemm(bool transA, bool transB, uint32_t M, uint32_t N, uint32_t K, float alpha,
+	const float* A, uint32_t lda, const float* B, uint32_t ldb, float beta, float* C, uint32_t ldc)
+{
+	if (beta != 1.0f)
+	{
+		for (uint32_t i = 0; i < M; ++i)
+		{
+			float* row = C + size_t(i) * ldc;
+			for (uint32_t j = 0; j < N; ++j)
+			{
+				row[j] = beta == 0.0f ? 0.0f : row[j] * beta;
+			}
+		}
+	}
+	if (M == 0 || N == 0 || K == 0 || alpha == 0.0f)
+	{
+		return;
+	}
+	thread_local std::vector<float> s_packedA;
+	thread_local std::vector<float> s_packedB;
+	s_packedA.resize(size_t(gemm_mc) * gemm_kc);
+	s_packedB.resize(size_t(gemm_kc) * gemm_nc);
+	for (uint32_t j0 = 0; j0 < N; j0 += gemm_nc)
+	{
+		uint32_t nc = std::min(gemm_nc, N - j0);
+		for (uint32_t k0 = 0; k0 < K; k0 += gemm_kc)
+		{
+			uint32_t kc = std::min(gemm_kc, K - k0);
+			GemmPackB(transB, B, ldb, k0, kc, j0, nc, s_packedB.data());
+			for (uint32_t i0 = 0; i0 < M; i0 += gemm_mc)
+			{
+				uint32_t mc = std::min(gemm_mc, M - i0);
+				GemmPackA(transA, A, lda, i0, mc, k0, kc, alpha, s_packedA.data());
+				for (uint32_t q = 0; q < nc; q += gemm_nr)
+				{
+					for (uint32_t p = 0; p < mc; p += gemm_mr)
+					{
+						GemmMicroKernel(kc, &s_packedA[size_t(p) * kc], &s_packedB[size_t(q) * kc], C + size_t(i0 + p) * ldc + j0 + q, ldc,
+							std::min(gemm_mr, mc - p), std::min(gemm_nr, nc - q));
+					}
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,299 @@
+#pragma once
+//http://yann.lecun.com/exdb/mnist/
+//magic number: 0x00 0x00 <type> <dimension count>, then one big-endian uint32 per dimension, then the big-endian elements
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <vector>
+#include <string>
+#include "simd.h"
+
+enum class IdxType : uint8_t
+{
+	UInt8 = 0x08,
+	Int8 = 0x09,
+	Int16 = 0x0B,
+	Int32 = 0x0C,
+	Float32 = 0x0D,
+	Float64 = 0x0E,
+};
+
+template<typename T>
+struct IdxTypeOf;
+
+template<> struct IdxTypeOf<uint8_t> { static const IdxType value = IdxType::UInt8; };
+template<> struct IdxTypeOf<int8_t> { static const IdxType value = IdxType::Int8; };
+template<> struct IdxTypeOf<int16_t> { static const IdxType value = IdxType::Int16; };
+template<> struct IdxTypeOf<int32_t> { static const IdxType value = IdxType::Int32; };
+template<> struct IdxTypeOf<float> { static const IdxType value = IdxType::Float32; };
+template<> struct IdxTypeOf<double> { static const IdxType value = IdxType::Float64; };
+
+struct IdxHeader
+{
+	uint32_t magicNumber;
+	IdxType type;
+	std::vector<uint32_t> dimensions;
+public:
+	size_t elementCount() const
+	{
+		size_t count = 1;
+		for (uint32_t dimension : dimensions)
+		{
+			count *= dimension;
+		}
+		return count;
+	}
+};
+
+const size_t idx_io_chunk_size = 64 * 1024;
+
+inline uint32_t IdxElementSize(IdxType type)
+{
+	switch (type)
+	{
+	case IdxType::UInt8:
+	case IdxType::Int8:
+		return 1;
+	case IdxType::Int16:
+		return 2;
+	case IdxType::Int32:
+	case IdxType::Float32:
+		return 4;
+	case IdxType::Float64:
+		return 8;
+	}
+	return 0;
+}
+
+constexpr uint32_t IdxMagicNumber(IdxType type, uint32_t dimensionCount)
+{
+	return (uint32_t(type) << 8) | dimensionCount;
+}
+
+//in-place big-endian <-> little-endian swap of count elements of elementSize bytes
+inline void IdxSwapBytes(void* data, size_t count, uint32_t elementSize)
+{
+	uint8_t* bytes = (uint8_t*)data;
+	size_t byteCount = count * elementSize;
+	size_t i = 0;
+	if (elementSize == 1)
+	{
+		return;
+	}
+#if MNIST_SSE2
+	//swap the 16-bit words of each element with a shuffle, then the two bytes of each word with shifts
+	for (; i + 16 <= byteCount; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(bytes + i));
+		if (elementSize == 4)
+		{
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		}
+		else if (elementSize == 8)
+		{
+			v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+			v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		}
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i*)(bytes + i), v);
+	}
+#endif
+	for (; i < byteCount; i += elementSize)
+	{
+		for (uint32_t lo = 0, hi = elementSize - 1; lo < hi; ++lo, --hi)
+		{
+			uint8_t tmp = bytes[i + lo];
+			bytes[i + lo] = bytes[i + hi];
+			bytes[i + hi] = tmp;
+		}
+	}
+}
+
+inline bool ReadIdxHeader(std::istream& file, IdxHeader& header)
+{
+	uint8_t magic[4];
+	if (!file.read((char*)magic, sizeof(magic)))
+	{
+		return false;
+	}
+	header.magicNumber = (uint32_t(magic[0]) << 24) | (uint32_t(magic[1]) << 16) | (uint32_t(magic[2]) << 8) | uint32_t(magic[3]);
+	header.type = IdxType(magic[2]);
+	if (magic[0] != 0 || magic[1] != 0 || IdxElementSize(header.type) == 0)
+	{
+		return false;
+	}
+	header.dimensions.resize(magic[3]);
+	if (!header.dimensions.empty())
+	{
+		if (!file.read((char*)header.dimensions.data(), header.dimensions.size() * sizeof(uint32_t)))
+		{
+			return false;
+		}
+		IdxSwapBytes(header.dimensions.data(), header.dimensions.size(), sizeof(uint32_t));
+	}
+	return true;
+}
+
+inline bool WriteIdxHeader(std::ostream& file, IdxType type, const std::vector<uint32_t>& dimensions)
+{
+	if (dimensions.size() > 0xFF)
+	{
+		return false;
+	}
+	uint8_t magic[4] = { 0, 0, uint8_t(type), uint8_t(dimensions.size()) };
+	file.write((const char*)magic, sizeof(magic));
+	std::vector<uint32_t> bigEndian(dimensions);
+	IdxSwapBytes(bigEndian.data(), bigEndian.size(), sizeof(uint32_t));
+	file.write((const char*)bigEndian.data(), bigEndian.size() * sizeof(uint32_t));
+	return bool(file);
+}
+
+//reads count raw elements in chunks, swapping each chunk while it is still in cache
+inline bool ReadIdxElements(std::istream& file, void* data, size_t count, uint32_t elementSize)
+{
+	char* bytes = (char*)data;
+	size_t byteCount = count * elementSize;
+	size_t chunkSize = idx_io_chunk_size / elementSize * elementSize;
+	for (size_t offset = 0; offset < byteCount; offset += chunkSize)
+	{
+		size_t size = std::min(chunkSize, byteCount - offset);
+		if (!file.read(bytes + offset, size))
+		{
+			return false;
+		}
+		IdxSwapBytes(bytes + offset, size / elementSize, elementSize);
+	}
+	return true;
+}
+
+inline bool WriteIdxElements(std::ostream& file, const void* data, size_t count, uint32_t elementSize)
+{
+	const char* bytes = (const char*)data;
+	size_t byteCount = count * elementSize;
+	if (elementSize == 1)
+	{
+		file.write(bytes, byteCount);
+		return bool(file);
+	}
+	size_t chunkSize = idx_io_chunk_size / elementSize * elementSize;
+	std::vector<char> buffer(std::min(chunkSize, byteCount));
+	for (size_t offset = 0; offset < byteCount; offset += chunkSize)
+	{
+		size_t size = std::min(chunkSize, byteCount - offset);
+		memcpy(buffer.data(), bytes + offset, size);
+		IdxSwapBytes(buffer.data(), size / elementSize, elementSize);
+		file.write(buffer.data(), size);
+	}
+	return bool(file);
+}
+
+template<typename T, typename S>
+inline bool ReadIdxElementsAs(std::istream& file, T* data, size_t count)
+{
+	std::vector<S> buffer(std::min(count, idx_io_chunk_size / sizeof(S)));
+	for (size_t offset = 0; offset < count; offset += buffer.size())
+	{
+		size_t size = std::min(buffer.size(), count - offset);
+		if (!ReadIdxElements(file, buffer.data(), size, sizeof(S)))
+		{
+			return false;
+		}
+		for (size_t i = 0; i < size; ++i)
+		{
+			data[offset + i] = T(buffer[i]);
+		}
+	}
+	return true;
+}
+
+//true when the bytes left in file hold the elements the header announces; checked before anything is allocated,
+//so a corrupt dimension fails the read instead of a huge allocation
+inline bool IdxPayloadFits(std::istream& file, const IdxHeader& header)
+{
+	std::streampos position = file.tellg();
+	file.seekg(0, std::ios::end);
+	std::streampos end = file.tellg();
+	file.seekg(position);
+	if (position < 0 || end < position || !file)
+	{
+		return false;
+	}
+	uint64_t available = uint64_t(end - position) / IdxElementSize(header.type);
+	uint64_t count = 1;
+	for (uint32_t dimension : header.dimensions)
+	{
+		if (dimension != 0 && count > available / dimension)
+		{
+			return false;
+		}
+		count *= dimension;
+	}
+	return count <= available;
+}
+
+//reads the elements following an already read header into data, converting them to T when the stored type differs
+template<typename T>
+inline bool ReadIdxData(std::istream& file, const IdxHeader& header, std::vector<T>& data)
+{
+	if (!IdxPayloadFits(file, header))
+	{
+		return false;
+	}
+	size_t count = header.elementCount();
+	data.resize(count);
+	if (header.type == IdxTypeOf<T>::value)
+	{
+		return ReadIdxElements(file, data.data(), count, sizeof(T));
+	}
+	switch (header.type)
+	{
+	case IdxType::UInt8:
+		return ReadIdxElementsAs<T, uint8_t>(file, data.data(), count);
+	case IdxType::Int8:
+		return ReadIdxElementsAs<T, int8_t>(file, data.data(), count);
+	case IdxType::Int16:
+		return ReadIdxElementsAs<T, int16_t>(file, data.data(), count);
+	case IdxType::Int32:
+		return ReadIdxElementsAs<T, int32_t>(file, data.data(), count);
+	case IdxType::Float32:
+		return ReadIdxElementsAs<T, float>(file, data.data(), count);
+	case IdxType::Float64:
+		return ReadIdxElementsAs<T, double>(file, data.data(), count);
+	}
+	return false;
+}
+
+//reads an idx file of any element type into data, converting the elements to T when the stored type differs
+template<typename T>
+inline bool ReadIdxData(IdxHeader& header, std::vector<T>& data, const std::string& fileName)
+{
+	std::ifstream file(fileName, std::ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	return ReadIdxHeader(file, header) && ReadIdxData(file, header, data);
+}
+
+template<typename T>
+inline bool WriteIdxData(const std::vector<uint32_t>& dimensions, const T* data, const std::string& fileName)
+{
+	std::ofstream file(fileName, std::ios::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	if (!WriteIdxHeader(file, IdxTypeOf<T>::value, dimensions))
+	{
+		return false;
+	}
+	size_t count = 1;
+	for (uint32_t dimension : dimensions)
+	{
+		count *= dimension;
+	}
+	return WriteIdxElements(file, data, count, sizeof(T));
+}
@@ -0,0 +1,387 @@
+﻿#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include "../mnist.h"
+#include "../simd.h"
+#include "../parallel.h"
+
+enum class KnnMetric
+{
+	L1,
+	L2,//squared
+};
+
+//sum |a[i] - b[i]|, psadbw handles 16 pixels per instruction
+inline uint32_t DistanceL1(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+	uint32_t i = 0;
+	uint32_t sum = 0;
+#if MNIST_SSE2
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+	}
+	sum = uint32_t(_mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8)));
+#endif
+	for (; i < n; ++i)
+	{
+		sum += uint32_t(std::abs(int32_t(a[i]) - int32_t(b[i])));
+	}
+	return sum;
+}
+
+//sum (a[i] - b[i])^2, the differences are widened to int16 and squared and pair-summed into int32 by pmaddwd
+inline uint32_t DistanceL2(const uint8_t* a, const uint8_t* b, uint32_t n)
+{
+	uint32_t i = 0;
+	uint32_t sum = 0;
+#if MNIST_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+	}
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	sum = uint32_t(_mm_cvtsi128_si32(acc));
+#endif
+	for (; i < n; ++i)
+	{
+		int32_t d = int32_t(a[i]) - int32_t(b[i]);
+		sum += uint32_t(d * d);
+	}
+	return sum;
+}
+
+//same two kernels over the int16 block sums of the coarse index, n a multiple of 8
+inline uint32_t CoarseDistance(const uint16_t* a, const uint16_t* b, uint32_t n, KnnMetric metric)
+{
+	uint32_t sum = 0;
+#if MNIST_SSE2
+	__m128i ones = _mm_set1_epi16(1);
+	__m128i acc = _mm_setzero_si128();
+	for (uint32_t i = 0; i < n; i += 8)
+	{
+		__m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+		if (metric == KnnMetric::L1)
+		{
+			__m128i d = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(d, ones));
+		}
+		else
+		{
+			__m128i d = _mm_sub_epi16(va, vb);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(d, d));
+		}
+	}
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	sum = uint32_t(_mm_cvtsi128_si32(acc));
+#else
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		int32_t d = int32_t(a[i]) - int32_t(b[i]);
+		sum += uint32_t(metric == KnnMetric::L1 ? std::abs(d) : d * d);
+	}
+#endif
+	return sum;
+}
+
+//bounded max-heap holding the k nearest (distance, label) pairs seen so far
+class KnnHeap
+{
+public:
+	KnnHeap(uint32_t k) :
+		m_k(k)
+	{
+		m_entries.reserve(k);
+	}
+public:
+	bool full() const
+	{
+		return m_entries.size() == m_k;
+	}
+	uint32_t worst() const
+	{
+		return m_entries.front().first;
+	}
+	void push(uint32_t distance, uint8_t label)
+	{
+		if (!full())
+		{
+			m_entries.push_back(std::make_pair(distance, label));
+			std::push_heap(m_entries.begin(), m_entries.end());
+		}
+		else if (distance < worst())
+		{
+			std::pop_heap(m_entries.begin(), m_entries.end());
+			m_entries.back() = std::make_pair(distance, label);
+			std::push_heap(m_entries.begin(), m_entries.end());
+		}
+	}
+	//majority label, ties go to the label with the nearest neighbour
+	uint8_t vote()
+	{
+		std::sort_heap(m_entries.begin(), m_entries.end());
+		uint32_t votes[256] = {};
+		uint8_t best = m_entries.front().second;
+		for (const auto& entry : m_entries)
+		{
+			if (++votes[entry.second] > votes[best])
+			{
+				best = entry.second;
+			}
+		}
+		return best;
+	}
+private:
+	uint32_t m_k;
+	std::vector<std::pair<uint32_t, uint8_t>> m_entries;
+};
+
+const uint32_t knn_coarse_factor = 4;//28x28 -> 7x7
+const uint32_t knn_query_block = 8;
+const uint32_t knn_reference_block = 256;//256 images, about 200KB, stay in L2 while a query block runs over them
+const uint32_t knn_seed_factor = 4;//the heap starts from the exact distances of the k * knn_seed_factor coarse-nearest references
+const uint32_t knn_seeded = 0xFFFFFFFF;//lower bound marking a reference already measured while seeding
+
+class KNearestNeighbors
+{
+public:
+	KNearestNeighbors(uint32_t rowCount, uint32_t columnCount, uint32_t k, KnnMetric metric, bool coarseFilter = true) :
+		m_rowCount(rowCount),
+		m_columnCount(columnCount),
+		m_featureDimension(rowCount * columnCount),
+		m_k(k),
+		m_metric(metric),
+		m_coarseFilter(coarseFilter && rowCount % knn_coarse_factor == 0 && columnCount % knn_coarse_factor == 0),
+		m_coarseDimension((rowCount / knn_coarse_factor * (columnCount / knn_coarse_factor) + 7) / 8 * 8),
+		m_referenceCount(0),
+		m_references(NumaPlacement::Replicate),
+		m_labels(NumaPlacement::Replicate),
+		m_coarseReferences(NumaPlacement::Replicate),
+		m_exactCount(0),
+		m_skippedCount(0)
+	{}
+public:
+	void fit(const uint8_t* images, const uint8_t* labels, uint32_t count)
+	{
+		m_referenceCount = count;
+		m_references.assign(images, size_t(count) * m_featureDimension);
+		m_labels.assign(labels, count);
+		if (m_coarseFilter)
+		{
+			std::vector<uint16_t> coarse = coarseIndex(images, count);
+			m_coarseReferences.assign(coarse.data(), coarse.size());
+		}
+	}
+	void predict(const uint8_t* queries, uint32_t count, uint8_t* predictions)
+	{
+		std::vector<uint16_t> coarseQueries = m_coarseFilter ? coarseIndex(queries, count) : std::vector<uint16_t>();
+		uint32_t numBlocks = (count + knn_query_block - 1) / knn_query_block;
+		ParallelFor(numBlocks, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			const uint8_t* references = m_references.data();
+			const uint8_t* labels = m_labels.data();
+			const uint16_t* coarseReferences = m_coarseFilter ? m_coarseReferences.data() : nullptr;
+			uint64_t exactCount = 0;
+			uint64_t skippedCount = 0;
+			std::vector<uint32_t> bounds;
+			std::vector<std::pair<uint32_t, uint32_t>> seeds;
+			for (uint32_t block = begin; block < end; ++block)
+			{
+				uint32_t q0 = block * knn_query_block;
+				uint32_t q1 = std::min(count, q0 + knn_query_block);
+				std::vector<KnnHeap> heaps(q1 - q0, KnnHeap(m_k));
+				if (coarseReferences && m_referenceCount > 0)
+				{
+					//the coarse bounds of every reference, and a heap seeded from the coarse-nearest ones: scanning the references in
+					//index order would only tighten heap.worst() slowly and let most lower bounds pass
+					bounds.resize(size_t(q1 - q0) * m_referenceCount);
+					for (uint32_t q = q0; q < q1; ++q)
+					{
+						const uint16_t* coarseQuery = &coarseQueries[size_t(q) * m_coarseDimension];
+						uint32_t* queryBounds = &bounds[size_t(q - q0) * m_referenceCount];
+						//seeds collects the numSeeds smallest bounds as a max-heap while the bounds are computed
+						uint32_t numSeeds = std::min(m_referenceCount, m_k * knn_seed_factor);
+						seeds.clear();
+						for (uint32_t r = 0; r < m_referenceCount; ++r)
+						{
+							uint32_t bound = lowerBound(coarseQuery, coarseReferences + size_t(r) * m_coarseDimension);
+							queryBounds[r] = bound;
+							if (seeds.size() < numSeeds)
+							{
+								seeds.push_back(std::make_pair(bound, r));
+								std::push_heap(seeds.begin(), seeds.end());
+							}
+							else if (bound < seeds.front().first)
+							{
+								std::pop_heap(seeds.begin(), seeds.end());
+								seeds.back() = std::make_pair(bound, r);
+								std::push_heap(seeds.begin(), seeds.end());
+							}
+						}
+						const uint8_t* query = queries + size_t(q) * m_featureDimension;
+						for (const auto& seed : seeds)
+						{
+							uint32_t r = seed.second;
+							heaps[q - q0].push(distance(query, references + size_t(r) * m_featureDimension), labels[r]);
+							queryBounds[r] = knn_seeded;
+						}
+						exactCount += numSeeds;
+					}
+				}
+				for (uint32_t r0 = 0; r0 < m_referenceCount; r0 += knn_reference_block)
+				{
+					uint32_t r1 = std::min(m_referenceCount, r0 + knn_reference_block);
+					for (uint32_t q = q0; q < q1; ++q)
+					{
+						KnnHeap& heap = heaps[q - q0];
+						const uint8_t* query = queries + size_t(q) * m_featureDimension;
+						const uint32_t* queryBounds = coarseReferences ? &bounds[size_t(q - q0) * m_referenceCount] : nullptr;
+						for (uint32_t r = r0; r < r1; ++r)
+						{
+							if (queryBounds)
+							{
+								if (queryBounds[r] == knn_seeded)
+								{
+									continue;
+								}
+								if (heap.full() && queryBounds[r] >= heap.worst())
+								{
+									++skippedCount;
+									continue;
+								}
+							}
+							heap.push(distance(query, references + size_t(r) * m_featureDimension), labels[r]);
+							++exactCount;
+						}
+					}
+				}
+				for (uint32_t q = q0; q < q1; ++q)
+				{
+					predictions[q] = heaps[q - q0].vote();
+				}
+			}
+			m_exactCount += exactCount;
+			m_skippedCount += skippedCount;
+		});
+	}
+	float test(const uint8_t* images, const uint8_t* labels, uint32_t count)
+	{
+		std::vector<uint8_t> predictions(count);
+		predict(images, count, predictions.data());
+		uint32_t errorCount = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			if (predictions[i] != labels[i])
+			{
+				++errorCount;
+			}
+		}
+		return float(errorCount) / float(count);
+	}
+	//fraction of reference distances the coarse index ruled out
+	double skippedRatio() const
+	{
+		uint64_t total = m_exactCount + m_skippedCount;
+		return total ? double(m_skippedCount) / total : 0;
+	}
+private:
+	//per image the sums of its knn_coarse_factor x knn_coarse_factor blocks, zero padded to m_coarseDimension
+	std::vector<uint16_t> coarseIndex(const uint8_t* images, uint32_t count) const
+	{
+		uint32_t coarseColumns = m_columnCount / knn_coarse_factor;
+		std::vector<uint16_t> coarse(size_t(count) * m_coarseDimension, 0);
+		for (uint32_t n = 0; n < count; ++n)
+		{
+			const uint8_t* image = images + size_t(n) * m_featureDimension;
+			uint16_t* sums = &coarse[size_t(n) * m_coarseDimension];
+			for (uint32_t y = 0; y < m_rowCount; ++y)
+			{
+				for (uint32_t x = 0; x < m_columnCount; ++x)
+				{
+					sums[y / knn_coarse_factor * coarseColumns + x / knn_coarse_factor] += image[y * m_columnCount + x];
+				}
+			}
+		}
+		return coarse;
+	}
+	uint32_t distance(const uint8_t* query, const uint8_t* reference) const
+	{
+		return m_metric == KnnMetric::L1 ? DistanceL1(query, reference, m_featureDimension) : DistanceL2(query, reference, m_featureDimension);
+	}
+	//never above the exact distance: |sum(a - b)| <= sum|a - b| per block for L1, and sum(a - b)^2 / area <= sum (a - b)^2 for L2
+	uint32_t lowerBound(const uint16_t* a, const uint16_t* b) const
+	{
+		uint32_t distance = CoarseDistance(a, b, m_coarseDimension, m_metric);
+		return m_metric == KnnMetric::L1 ? distance : distance / (knn_coarse_factor * knn_coarse_factor);
+	}
+private:
+	uint32_t m_rowCount;
+	uint32_t m_columnCount;
+	uint32_t m_featureDimension;
+	uint32_t m_k;
+	KnnMetric m_metric;
+	bool m_coarseFilter;
+	uint32_t m_coarseDimension;
+	uint32_t m_referenceCount;
+	NumaBuffer<uint8_t> m_references;
+	NumaBuffer<uint8_t> m_labels;
+	NumaBuffer<uint16_t> m_coarseReferences;
+	std::atomic<uint64_t> m_exactCount;
+	std::atomic<uint64_t> m_skippedCount;
+};
+
+int main()
+{
+	std::string path = CMAKE_SOURCE_DIR;
+
+	MnistImageHeader trainImageHeader;
+	MnistLabelHeader trainLabelHeader;
+	MnistImageHeader testImageHeader;
+	MnistLabelHeader testLabelHeader;
+	std::vector<uint8_t> trainImages;
+	std::vector<uint8_t> trainLabels;
+	std::vector<uint8_t> testImages;
+	std::vector<uint8_t> testLabels;
+	bool b1 = ReadImageData(trainImageHeader, trainImages, path + "/data/train-images.idx3-ubyte");
+	bool b2 = ReadLabelData(trainLabelHeader, trainLabels, path + "/data/train-labels.idx1-ubyte");
+	bool b3 = ReadImageData(testImageHeader, testImages, path + "/data/t10k-images.idx3-ubyte");
+	bool b4 = ReadLabelData(testLabelHeader, testLabels, path + "/data/t10k-labels.idx1-ubyte");
+	if (!(b1 && b2 && b3 && b4))
+	{
+		return 0;
+	}
+
+	uint32_t featureDimension = trainImageHeader.columnCount * trainImageHeader.rowCount;
+	uint32_t validationCount = trainImageHeader.imageCount / 10;
+	uint32_t trainCount = trainImageHeader.imageCount - validationCount;
+	uint32_t testCount = testImageHeader.imageCount;
+
+	for (KnnMetric metric : { KnnMetric::L2, KnnMetric::L1 })
+	{
+		for (bool coarseFilter : { true, false })
+		{
+			KNearestNeighbors knn(trainImageHeader.rowCount, trainImageHeader.columnCount, 3, metric, coarseFilter);
+			knn.fit(trainImages.data(), trainLabels.data(), trainCount);
+			auto start = std::chrono::steady_clock::now();
+			float validationError = knn.test(trainImages.data() + size_t(trainCount) * featureDimension, trainLabels.data() + trainCount, validationCount);
+			float testError = knn.test(testImages.data(), testLabels.data(), testCount);
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			printf("%s k=3%s: error %f, %f in %.2fs, %.1f%% distances skipped\n", metric == KnnMetric::L1 ? "L1" : "L2",
+				coarseFilter ? " coarse" : "", validationError * 100, testError * 100, seconds, knn.skippedRatio() * 100);
+		}
+	}
+}
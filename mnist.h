@@ -4,9 +4,10 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include "idx.h"
 
-const uint32_t mnist_image_header_flag = 0x00000803;
-const uint32_t mnist_label_header_flag = 0x00000801;
+const uint32_t mnist_image_header_flag = IdxMagicNumber(IdxType::UInt8, 3);//0x00000803
+const uint32_t mnist_label_header_flag = IdxMagicNumber(IdxType::UInt8, 1);//0x00000801
 
 struct MnistImageHeader
 {
@@ -27,52 +28,39 @@ uint32_t ConvertEndian(uint32_t n)
 	return ((n << 24) & 0xFF000000) | ((n << 8) & 0x00FF0000) | ((n >> 8) & 0x0000FF00) | ((n >> 24) & 0x000000FF);
 }
 
+//the magic number is checked before any pixel is read
 inline bool ReadImageData(MnistImageHeader& header, std::vector<uint8_t>& data, const std::string& fileName)
 {
 	std::ifstream file(fileName, std::ios::binary);
-	if (!file.is_open())
+	IdxHeader idxHeader;
+	if (!file.is_open() || !ReadIdxHeader(file, idxHeader))
 	{
 		return false;
 	}
-	uint32_t tmp;
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.magicNumber = ConvertEndian(tmp);
-	if (header.magicNumber != mnist_image_header_flag)
+	header.magicNumber = idxHeader.magicNumber;
+	if (header.magicNumber != mnist_image_header_flag || !ReadIdxData(file, idxHeader, data))
 	{
 		return false;
 	}
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.imageCount = ConvertEndian(tmp);
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.rowCount = ConvertEndian(tmp);
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.columnCount = ConvertEndian(tmp);
-
-	uint32_t dataSize = header.imageCount*header.rowCount*header.columnCount;
-	data.resize(dataSize);
-	file.read((char*)data.data(), dataSize);
+	header.imageCount = idxHeader.dimensions[0];
+	header.rowCount = idxHeader.dimensions[1];
+	header.columnCount = idxHeader.dimensions[2];
 	return true;
 }
 
 inline bool ReadLabelData(MnistLabelHeader& header, std::vector<uint8_t>& data, const std::string& fileName)
 {
 	std::ifstream file(fileName, std::ios::binary);
-	if (!file.is_open())
+	IdxHeader idxHeader;
+	if (!file.is_open() || !ReadIdxHeader(file, idxHeader))
 	{
 		return false;
 	}
-	uint32_t tmp;
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.magicNumber = ConvertEndian(tmp);
-	if (header.magicNumber != mnist_label_header_flag)
+	header.magicNumber = idxHeader.magicNumber;
+	if (header.magicNumber != mnist_label_header_flag || !ReadIdxData(file, idxHeader, data))
 	{
 		return false;
 	}
-	file.read((char*)&tmp, sizeof(uint32_t));
-	header.labelCount = ConvertEndian(tmp);
-
-	uint32_t dataSize = header.labelCount;
-	data.resize(dataSize);
-	file.read((char*)data.data(), dataSize);
+	header.labelCount = idxHeader.dimensions[0];
 	return true;
 }
@@ -95,19 +95,15 @@ void mnist2bmp(const std::string& bmpFileName, const std::string&  mnistFileName
 	{
 		return;
 	}
-	uint32_t tmp;
-	mnistFile.read((char*)&tmp, sizeof(uint32_t));
-	mnistImageHeader.magicNumber = ConvertEndian(tmp);
-	if (mnistImageHeader.magicNumber != 0x00000803)
+	IdxHeader idxHeader;
+	if (!ReadIdxHeader(mnistFile, idxHeader) || idxHeader.magicNumber != mnist_image_header_flag)
 	{
 		return;
 	}
-	mnistFile.read((char*)&tmp, sizeof(uint32_t));
-	mnistImageHeader.imageCount = ConvertEndian(tmp);
-	mnistFile.read((char*)&tmp, sizeof(uint32_t));
-	mnistImageHeader.rowCount = ConvertEndian(tmp);
-	mnistFile.read((char*)&tmp, sizeof(uint32_t));
-	mnistImageHeader.columnCount = ConvertEndian(tmp);
+	mnistImageHeader.magicNumber = idxHeader.magicNumber;
+	mnistImageHeader.imageCount = idxHeader.dimensions[0];
+	mnistImageHeader.rowCount = idxHeader.dimensions[1];
+	mnistImageHeader.columnCount = idxHeader.dimensions[2];
 
 	if (imagePerRow < 1)
 	{
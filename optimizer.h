@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include "simd.h"
+
+//per-parameter-block state, owned by the model next to the parameters it belongs to
+struct OptimizerState
+{
+	std::vector<float> firstMoments;
+	std::vector<float> secondMoments;
+	uint32_t step = 0;
+};
+
+//every kernel does the batch scaling, the state update and the parameter write in a single pass over memory
+class Optimizer
+{
+public:
+	virtual ~Optimizer() {}
+public:
+	//grads are the derivates summed over the batch, gradScale is usually 1 / batchSize
+	virtual void update(float* params, const float* grads, OptimizerState& state, uint32_t count, float gradScale, float learningRate) = 0;
+};
+
+class SgdOptimizer : public Optimizer
+{
+public:
+	void update(float* params, const float* grads, OptimizerState& state, uint32_t count, float gradScale, float learningRate) override
+	{
+		++state.step;
+		SgdKernel(params, grads, count, gradScale * learningRate);
+	}
+public:
+	static void SgdKernel(float* MNIST_RESTRICT params, const float* MNIST_RESTRICT grads, uint32_t count, float scale)
+	{
+		uint32_t i = 0;
+#if MNIST_SSE2
+		__m128 s = _mm_set1_ps(scale);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 p = _mm_loadu_ps(params + i);
+			__m128 g = _mm_loadu_ps(grads + i);
+			_mm_storeu_ps(params + i, _mm_sub_ps(p, _mm_mul_ps(s, g)));
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			params[i] -= scale * grads[i];
+		}
+	}
+	static SgdOptimizer* GetInstance()
+	{
+		static SgdOptimizer s_instance;
+		return &s_instance;
+	}
+};
+
+//v = momentum * v + g, p -= eta * v; nesterov applies p -= eta * (g + momentum * v) with the new v
+class MomentumOptimizer : public Optimizer
+{
+public:
+	MomentumOptimizer(float momentum = 0.9f, bool nesterov = false) :
+		m_momentum(momentum),
+		m_nesterov(nesterov)
+	{}
+public:
+	void update(float* params, const float* grads, OptimizerState& state, uint32_t count, float gradScale, float learningRate) override
+	{
+		state.firstMoments.resize(count);
+		++state.step;
+		if (m_nesterov)
+		{
+			MomentumKernel<true>(params, grads, state.firstMoments.data(), count, gradScale, learningRate, m_momentum);
+		}
+		else
+		{
+			MomentumKernel<false>(params, grads, state.firstMoments.data(), count, gradScale, learningRate, m_momentum);
+		}
+	}
+public:
+	template<bool nesterov>
+	static void MomentumKernel(float* MNIST_RESTRICT params, const float* MNIST_RESTRICT grads, float* MNIST_RESTRICT velocities,
+		uint32_t count, float gradScale, float learningRate, float momentum)
+	{
+		uint32_t i = 0;
+#if MNIST_SSE2
+		__m128 gs = _mm_set1_ps(gradScale);
+		__m128 lr = _mm_set1_ps(learningRate);
+		__m128 mu = _mm_set1_ps(momentum);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 g = _mm_mul_ps(_mm_loadu_ps(grads + i), gs);
+			__m128 v = _mm_add_ps(_mm_mul_ps(mu, _mm_loadu_ps(velocities + i)), g);
+			_mm_storeu_ps(velocities + i, v);
+			__m128 step = nesterov ? _mm_add_ps(g, _mm_mul_ps(mu, v)) : v;
+			_mm_storeu_ps(params + i, _mm_sub_ps(_mm_loadu_ps(params + i), _mm_mul_ps(lr, step)));
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			float g = grads[i] * gradScale;
+			float v = momentum * velocities[i] + g;
+			velocities[i] = v;
+			params[i] -= learningRate * (nesterov ? g + momentum * v : v);
+		}
+	}
+private:
+	float m_momentum;
+	bool m_nesterov;
+};
+
+//adam with bias correction; a non-zero weightDecay gives adamw (decay decoupled from the gradient)
+class AdamOptimizer : public Optimizer
+{
+public:
+	AdamOptimizer(float beta1 = 0.9f, float beta2 = 0.999f, float epsilon = 1e-8f, float weightDecay = 0) :
+		m_beta1(beta1),
+		m_beta2(beta2),
+		m_epsilon(epsilon),
+		m_weightDecay(weightDecay)
+	{}
+public:
+	void update(float* params, const float* grads, OptimizerState& state, uint32_t count, float gradScale, float learningRate) override
+	{
+		state.firstMoments.resize(count);
+		state.secondMoments.resize(count);
+		++state.step;
+		float correction1 = 1.0f / (1.0f - std::pow(m_beta1, float(state.step)));
+		float correction2 = 1.0f / (1.0f - std::pow(m_beta2, float(state.step)));
+		AdamKernel(params, grads, state.firstMoments.data(), state.secondMoments.data(), count, gradScale, learningRate,
+			m_beta1, m_beta2, m_epsilon, m_weightDecay, correction1, correction2);
+	}
+public:
+	static void AdamKernel(float* MNIST_RESTRICT params, const float* MNIST_RESTRICT grads, float* MNIST_RESTRICT firstMoments, float* MNIST_RESTRICT secondMoments,
+		uint32_t count, float gradScale, float learningRate, float beta1, float beta2, float epsilon, float weightDecay, float correction1, float correction2)
+	{
+		float decay = 1.0f - learningRate * weightDecay;
+		uint32_t i = 0;
+#if MNIST_SSE2
+		__m128 gs = _mm_set1_ps(gradScale);
+		__m128 lr = _mm_set1_ps(learningRate * correction1);
+		__m128 b1 = _mm_set1_ps(beta1);
+		__m128 b2 = _mm_set1_ps(beta2);
+		__m128 ob1 = _mm_set1_ps(1.0f - beta1);
+		__m128 ob2 = _mm_set1_ps(1.0f - beta2);
+		__m128 eps = _mm_set1_ps(epsilon);
+		__m128 c2 = _mm_set1_ps(correction2);
+		__m128 wd = _mm_set1_ps(decay);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 g = _mm_mul_ps(_mm_loadu_ps(grads + i), gs);
+			__m128 m = _mm_add_ps(_mm_mul_ps(b1, _mm_loadu_ps(firstMoments + i)), _mm_mul_ps(ob1, g));
+			__m128 v = _mm_add_ps(_mm_mul_ps(b2, _mm_loadu_ps(secondMoments + i)), _mm_mul_ps(ob2, _mm_mul_ps(g, g)));
+			_mm_storeu_ps(firstMoments + i, m);
+			_mm_storeu_ps(secondMoments + i, v);
+			__m128 denominator = _mm_add_ps(_mm_sqrt_ps(_mm_mul_ps(v, c2)), eps);
+			__m128 p = _mm_mul_ps(_mm_loadu_ps(params + i), wd);
+			_mm_storeu_ps(params + i, _mm_sub_ps(p, _mm_div_ps(_mm_mul_ps(lr, m), denominator)));
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			float g = grads[i] * gradScale;
+			float m = beta1 * firstMoments[i] + (1.0f - beta1) * g;
+			float v = beta2 * secondMoments[i] + (1.0f - beta2) * g * g;
+			firstMoments[i] = m;
+			secondMoments[i] = v;
+			params[i] = params[i] * decay - learningRate * correction1 * m / (std::sqrt(v * correction2) + epsilon);
+		}
+	}
+private:
+	float m_beta1;
+	float m_beta2;
+	float m_epsilon;
+	float m_weightDecay;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include "threadpool.h"
+
+//number of distinct threadIndex values ParallelFor hands out, for sizing per-thread workspaces
+inline uint32_t ParallelThreadCount()
+{
+	return ThreadPool::GetInstance().numThreads();
+}
+
+//splits [0, count) into contiguous ranges run on the shared pool and calls fn(begin, end, threadIndex), threadIndex < ParallelThreadCount()
+inline void ParallelFor(uint32_t count, const std::function<void(uint32_t, uint32_t, uint32_t)>& fn, uint32_t minPerThread = 1)
+{
+	ThreadPool::GetInstance().parallelFor(count, fn, minPerThread);
+}
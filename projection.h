@@ -0,0 +1,439 @@
+#pragma once
+//linear dimensionality reduction applied to raw images before training: outputs = (images / 255 - mean) * components^T.
+//fitted once on the training set and persisted as one float idx matrix (row 0 the mean, then one row per component)
+//so inference applies exactly the same transform. mostly-zero components (random projections) are kept in compressed
+//rows and applied without touching the zeros
+
+#include <cstdint>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "idx.h"
+#include "gemm.h"
+#include "parallel.h"
+
+//eigen-decomposition of the symmetric n x n matrix a by cyclic jacobi rotations; a is destroyed, its diagonal ends up holding the eigenvalues.
+//vectors receives the eigenvectors as rows. meant for the small projected matrices of the randomized solver
+inline void JacobiEigen(std::vector<double>& a, uint32_t n, std::vector<double>& vectors, uint32_t maxSweeps = 50)
+{
+	vectors.assign(size_t(n) * n, 0.0);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		vectors[size_t(i) * n + i] = 1.0;
+	}
+	for (uint32_t sweep = 0; sweep < maxSweeps; ++sweep)
+	{
+		double offDiagonal = 0;
+		for (uint32_t p = 0; p < n; ++p)
+		{
+			for (uint32_t q = p + 1; q < n; ++q)
+			{
+				offDiagonal += a[size_t(p) * n + q] * a[size_t(p) * n + q];
+			}
+		}
+		if (offDiagonal < 1e-22)
+		{
+			break;
+		}
+		for (uint32_t p = 0; p < n; ++p)
+		{
+			for (uint32_t q = p + 1; q < n; ++q)
+			{
+				double apq = a[size_t(p) * n + q];
+				if (std::fabs(apq) < 1e-300)
+				{
+					continue;
+				}
+				double theta = (a[size_t(q) * n + q] - a[size_t(p) * n + p]) / (2.0 * apq);
+				double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+				double c = 1.0 / std::sqrt(t * t + 1.0);
+				double s = t * c;
+				for (uint32_t k = 0; k < n; ++k)
+				{
+					double akp = a[size_t(k) * n + p];
+					double akq = a[size_t(k) * n + q];
+					a[size_t(k) * n + p] = c * akp - s * akq;
+					a[size_t(k) * n + q] = s * akp + c * akq;
+				}
+				for (uint32_t k = 0; k < n; ++k)
+				{
+					double apk = a[size_t(p) * n + k];
+					double aqk = a[size_t(q) * n + k];
+					a[size_t(p) * n + k] = c * apk - s * aqk;
+					a[size_t(q) * n + k] = s * apk + c * aqk;
+				}
+				for (uint32_t k = 0; k < n; ++k)
+				{
+					double vpk = vectors[size_t(p) * n + k];
+					double vqk = vectors[size_t(q) * n + k];
+					vectors[size_t(p) * n + k] = c * vpk - s * vqk;
+					vectors[size_t(q) * n + k] = s * vpk + c * vqk;
+				}
+			}
+		}
+	}
+}
+
+//modified gram-schmidt on the rows of the count x dimension matrix rows
+inline void OrthonormalizeRows(std::vector<float>& rows, uint32_t count, uint32_t dimension)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		float* row = &rows[size_t(i) * dimension];
+		double originalNorm = 0;
+		for (uint32_t d = 0; d < dimension; ++d)
+		{
+			originalNorm += double(row[d]) * row[d];
+		}
+		for (uint32_t j = 0; j < i; ++j)
+		{
+			const float* other = &rows[size_t(j) * dimension];
+			double dot = 0;
+			for (uint32_t d = 0; d < dimension; ++d)
+			{
+				dot += double(row[d]) * other[d];
+			}
+			for (uint32_t d = 0; d < dimension; ++d)
+			{
+				row[d] -= float(dot) * other[d];
+			}
+		}
+		double norm = 0;
+		for (uint32_t d = 0; d < dimension; ++d)
+		{
+			norm += double(row[d]) * row[d];
+		}
+		//what is left of a row dependent on the earlier ones is rounding noise, normalizing it would add a spurious direction
+		float scale = norm > 1e-8 * originalNorm ? float(1.0 / std::sqrt(norm)) : 0.0f;
+		for (uint32_t d = 0; d < dimension; ++d)
+		{
+			row[d] *= scale;
+		}
+	}
+}
+
+class Projection
+{
+public:
+	Projection() :
+		m_inputDimension(0),
+		m_outputDimension(0),
+		m_totalVariance(0)
+	{}
+public:
+	uint32_t inputDimension() const
+	{
+		return m_inputDimension;
+	}
+	uint32_t outputDimension() const
+	{
+		return m_outputDimension;
+	}
+	//top outputDimension principal components: blocked covariance gemm, then subspace iteration with oversampling and
+	//a jacobi solve of the small projected matrix (randomized svd of the symmetric covariance); at most inputDimension components exist
+	void fitPca(const uint8_t* images, uint32_t count, uint32_t inputDimension, uint32_t outputDimension, uint32_t powerIterations = 6, uint32_t seed = 1)
+	{
+		outputDimension = std::min(outputDimension, inputDimension);
+		m_inputDimension = inputDimension;
+		m_outputDimension = outputDimension;
+		uint32_t d = inputDimension;
+		fitMean(images, count);
+		clearSparse();
+
+		//covariance = centered^T * centered / (count - 1), accumulated over row chunks, every thread owning a band of covariance rows
+		const uint32_t chunkSize = 4096;
+		std::vector<float> covariance(size_t(d) * d, 0.0f);
+		std::vector<float> centered;
+		for (uint32_t begin = 0; begin < count; begin += chunkSize)
+		{
+			uint32_t size = std::min(chunkSize, count - begin);
+			center(images + size_t(begin) * d, size, centered);
+			ParallelFor(d, [&](uint32_t rowBegin, uint32_t rowEnd, uint32_t)
+			{
+				Gemm(true, false, rowEnd - rowBegin, d, size, 1.0f / std::max(1u, count - 1), centered.data() + rowBegin, d,
+					centered.data(), d, 1.0f, &covariance[size_t(rowBegin) * d], d);
+			}, 16);
+		}
+
+		m_totalVariance = 0;
+		for (uint32_t i = 0; i < d; ++i)
+		{
+			m_totalVariance += covariance[size_t(i) * d + i];
+		}
+
+		//basis rows span an approximation of the dominant subspace, refined by multiplying with the covariance
+		uint32_t rank = std::min(d, outputDimension + 10);
+		std::vector<float> basis(size_t(rank) * d);
+		std::mt19937 random(seed);
+		std::normal_distribution<float> normal;
+		for (auto& value : basis)
+		{
+			value = normal(random);
+		}
+		OrthonormalizeRows(basis, rank, d);
+		std::vector<float> product(size_t(rank) * d);
+		for (uint32_t iteration = 0; iteration < powerIterations; ++iteration)
+		{
+			multiply(covariance, basis, rank, product);
+			basis.swap(product);
+			OrthonormalizeRows(basis, rank, d);
+		}
+
+		//rayleigh-ritz: small = basis * covariance * basis^T, whose eigenvectors rotate basis onto the principal components
+		multiply(covariance, basis, rank, product);
+		std::vector<float> smallFloat(size_t(rank) * rank);
+		Gemm(false, true, rank, rank, d, 1.0f, basis.data(), d, product.data(), d, 0.0f, smallFloat.data(), rank);
+		std::vector<double> small(smallFloat.begin(), smallFloat.end());
+		std::vector<double> vectors;
+		JacobiEigen(small, rank, vectors);
+		std::vector<uint32_t> order(rank);
+		for (uint32_t i = 0; i < rank; ++i)
+		{
+			order[i] = i;
+		}
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return small[size_t(a) * rank + a] > small[size_t(b) * rank + b]; });
+		m_components.assign(size_t(outputDimension) * d, 0.0f);
+		m_eigenvalues.resize(outputDimension);
+		for (uint32_t c = 0; c < outputDimension; ++c)
+		{
+			const double* vector = &vectors[size_t(order[c]) * rank];
+			float* component = &m_components[size_t(c) * d];
+			for (uint32_t r = 0; r < rank; ++r)
+			{
+				for (uint32_t i = 0; i < d; ++i)
+				{
+					component[i] += float(vector[r]) * basis[size_t(r) * d + i];
+				}
+			}
+			m_eigenvalues[c] = float(small[size_t(order[c]) * rank + order[c]]);
+		}
+	}
+	//sparse random projection (Li et al.): entries +-sqrt(s / outputDimension) with probability 1 / (2s) each, zero otherwise, s = sqrt(inputDimension).
+	//only the mean needs a data pass; the about inputDimension / s non-zeros per output are stored compressed. like fitPca it only reduces,
+	//outputDimension is clamped to inputDimension
+	void fitRandom(const uint8_t* images, uint32_t count, uint32_t inputDimension, uint32_t outputDimension, uint32_t seed = 1)
+	{
+		outputDimension = std::min(outputDimension, inputDimension);
+		m_inputDimension = inputDimension;
+		m_outputDimension = outputDimension;
+		fitMean(images, count);
+		float s = std::sqrt(float(inputDimension));
+		float value = std::sqrt(s / outputDimension);
+		std::mt19937 random(seed);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		clearSparse();
+		m_sparseOffsets.push_back(0);
+		for (uint32_t o = 0; o < outputDimension; ++o)
+		{
+			for (uint32_t i = 0; i < inputDimension; ++i)
+			{
+				float u = uniform(random) * s;
+				if (u < 1.0f)
+				{
+					m_sparseIndices.push_back(i);
+					m_sparseValues.push_back(u < 0.5f ? value : -value);
+				}
+			}
+			m_sparseOffsets.push_back(uint32_t(m_sparseIndices.size()));
+		}
+		m_components.clear();
+		m_eigenvalues.clear();
+		m_totalVariance = 0;
+		updateSparseBiases();
+	}
+	bool sparse() const
+	{
+		return !m_sparseOffsets.empty();
+	}
+	//outputs is count x outputDimension
+	void transform(const uint8_t* images, uint32_t count, float* outputs) const
+	{
+		const uint32_t chunkSize = 4096;
+		ParallelFor((count + chunkSize - 1) / chunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			std::vector<float> centered;
+			for (uint32_t chunk = begin; chunk < end; ++chunk)
+			{
+				uint32_t first = chunk * chunkSize;
+				uint32_t size = std::min(chunkSize, count - first);
+				if (sparse())
+				{
+					transformSparse(images + size_t(first) * m_inputDimension, size, outputs + size_t(first) * m_outputDimension);
+					continue;
+				}
+				center(images + size_t(first) * m_inputDimension, size, centered);
+				Gemm(false, true, size, m_outputDimension, m_inputDimension, 1.0f, centered.data(), m_inputDimension,
+					m_components.data(), m_inputDimension, 0.0f, outputs + size_t(first) * m_outputDimension, m_outputDimension);
+			}
+		});
+	}
+	std::vector<float> transform(const uint8_t* images, uint32_t count) const
+	{
+		std::vector<float> outputs(size_t(count) * m_outputDimension);
+		transform(images, count, outputs.data());
+		return outputs;
+	}
+	//variance along each principal component, empty for a random projection
+	const std::vector<float>& eigenvalues() const
+	{
+		return m_eigenvalues;
+	}
+	//share of the total pixel variance kept by the principal components
+	float explainedVariance() const
+	{
+		float kept = 0;
+		for (float eigenvalue : m_eigenvalues)
+		{
+			kept += eigenvalue;
+		}
+		return m_totalVariance > 0 ? kept / m_totalVariance : 0.0f;
+	}
+	//sparse projections are written out dense, so every file has the same layout
+	bool save(const std::string& fileName) const
+	{
+		std::vector<float> rows(m_mean);
+		if (sparse())
+		{
+			rows.resize(size_t(m_outputDimension + 1) * m_inputDimension, 0.0f);
+			for (uint32_t o = 0; o < m_outputDimension; ++o)
+			{
+				for (uint32_t j = m_sparseOffsets[o]; j < m_sparseOffsets[o + 1]; ++j)
+				{
+					rows[size_t(o + 1) * m_inputDimension + m_sparseIndices[j]] = m_sparseValues[j];
+				}
+			}
+		}
+		else
+		{
+			rows.insert(rows.end(), m_components.begin(), m_components.end());
+		}
+		return WriteIdxData({ m_outputDimension + 1, m_inputDimension }, rows.data(), fileName);
+	}
+	bool load(const std::string& fileName)
+	{
+		IdxHeader header;
+		std::vector<float> rows;
+		if (!ReadIdxData(header, rows, fileName) || header.dimensions.size() != 2 || header.dimensions[0] < 1)
+		{
+			return false;
+		}
+		m_inputDimension = header.dimensions[1];
+		m_outputDimension = header.dimensions[0] - 1;
+		m_mean.assign(rows.begin(), rows.begin() + m_inputDimension);
+		m_components.assign(rows.begin() + m_inputDimension, rows.end());
+		m_eigenvalues.clear();
+		m_totalVariance = 0;
+		clearSparse();
+		//a matrix at most a quarter full is applied sparsely, which is what a saved random projection turns back into
+		size_t nonZeros = m_components.size() - std::count(m_components.begin(), m_components.end(), 0.0f);
+		if (nonZeros * 4 <= m_components.size())
+		{
+			m_sparseOffsets.push_back(0);
+			for (uint32_t o = 0; o < m_outputDimension; ++o)
+			{
+				for (uint32_t i = 0; i < m_inputDimension; ++i)
+				{
+					float value = m_components[size_t(o) * m_inputDimension + i];
+					if (value != 0.0f)
+					{
+						m_sparseIndices.push_back(i);
+						m_sparseValues.push_back(value);
+					}
+				}
+				m_sparseOffsets.push_back(uint32_t(m_sparseIndices.size()));
+			}
+			m_components.clear();
+			updateSparseBiases();
+		}
+		return true;
+	}
+private:
+	//sums in double, a float sum over a full training set gets close to 2^24 where integers stop being exact
+	void fitMean(const uint8_t* images, uint32_t count)
+	{
+		std::vector<double> sums(m_inputDimension, 0.0);
+		for (uint32_t n = 0; n < count; ++n)
+		{
+			for (uint32_t i = 0; i < m_inputDimension; ++i)
+			{
+				sums[i] += images[size_t(n) * m_inputDimension + i];
+			}
+		}
+		m_mean.resize(m_inputDimension);
+		for (uint32_t i = 0; i < m_inputDimension; ++i)
+		{
+			m_mean[i] = float(sums[i] / std::max(1u, count) / 255.0);
+		}
+	}
+	void clearSparse()
+	{
+		m_sparseOffsets.clear();
+		m_sparseIndices.clear();
+		m_sparseValues.clear();
+		m_sparseBiases.clear();
+	}
+	//the mean folded into one constant per output: outputs[o] = sum values * pixels / 255 - sum values * mean
+	void updateSparseBiases()
+	{
+		m_sparseBiases.assign(m_outputDimension, 0.0f);
+		for (uint32_t o = 0; o < m_outputDimension; ++o)
+		{
+			double bias = 0;
+			for (uint32_t j = m_sparseOffsets[o]; j < m_sparseOffsets[o + 1]; ++j)
+			{
+				bias += double(m_sparseValues[j]) * m_mean[m_sparseIndices[j]];
+			}
+			m_sparseBiases[o] = float(bias);
+		}
+	}
+	void transformSparse(const uint8_t* images, uint32_t count, float* outputs) const
+	{
+		for (uint32_t n = 0; n < count; ++n)
+		{
+			const uint8_t* image = images + size_t(n) * m_inputDimension;
+			float* output = outputs + size_t(n) * m_outputDimension;
+			for (uint32_t o = 0; o < m_outputDimension; ++o)
+			{
+				float sum = 0;
+				for (uint32_t j = m_sparseOffsets[o]; j < m_sparseOffsets[o + 1]; ++j)
+				{
+					sum += m_sparseValues[j] * image[m_sparseIndices[j]];
+				}
+				output[o] = sum / 255.0f - m_sparseBiases[o];
+			}
+		}
+	}
+	void center(const uint8_t* images, uint32_t count, std::vector<float>& centered) const
+	{
+		centered.resize(size_t(count) * m_inputDimension);
+		for (uint32_t n = 0; n < count; ++n)
+		{
+			for (uint32_t i = 0; i < m_inputDimension; ++i)
+			{
+				centered[size_t(n) * m_inputDimension + i] = images[size_t(n) * m_inputDimension + i] / 255.0f - m_mean[i];
+			}
+		}
+	}
+	//product = rows * covariance (= (covariance * rows^T)^T, covariance being symmetric)
+	void multiply(const std::vector<float>& covariance, const std::vector<float>& rows, uint32_t count, std::vector<float>& product) const
+	{
+		uint32_t d = m_inputDimension;
+		ParallelFor(count, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			Gemm(false, false, end - begin, d, d, 1.0f, &rows[size_t(begin) * d], d, covariance.data(), d, 0.0f, &product[size_t(begin) * d], d);
+		}, 8);
+	}
+private:
+	uint32_t m_inputDimension;
+	uint32_t m_outputDimension;
+	std::vector<float> m_mean;
+	std::vector<float> m_components;//dense outputDimension x inputDimension, empty when sparse
+	std::vector<uint32_t> m_sparseOffsets;//compressed rows: output o uses entries [offsets[o], offsets[o + 1])
+	std::vector<uint32_t> m_sparseIndices;
+	std::vector<float> m_sparseValues;
+	std::vector<float> m_sparseBiases;
+	std::vector<float> m_eigenvalues;
+	float m_totalVariance;
+};
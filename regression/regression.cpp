@@ -2,21 +2,43 @@
 #include <algorithm>
 #include <unordered_map>
 #include <map>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <string>
+#include <cstdlib>
 #include "../mnist.h"
+#include "../optimizer.h"
+#include "../gemm.h"
+#include "../parallel.h"
+#include "../checkpoint.h"
+#include "../projection.h"
 
 float sigmoid(float x)
 {
 	return 1.0 / (1.0 + exp(-x));
 }
 
-template<bool softmax = false>
+//raw pixels are scaled to [0, 1], projected features are used as they are
+inline float FeatureValue(uint8_t x)
+{
+	return x / 255.0f;
+}
+inline float FeatureValue(float x)
+{
+	return x;
+}
+
+template<bool softmax = false, typename Feature = uint8_t>
 class LogisticRegression
 {
 public:
-	LogisticRegression(uint32_t featureDimension, uint32_t numClassify)
+	LogisticRegression(uint32_t featureDimension, uint32_t numClassify, Optimizer* optimizer = SgdOptimizer::GetInstance())
 	{
 		m_featureDimension = featureDimension;
 		m_numClassify = numClassify;
+		m_optimizer = optimizer;
 		m_weights.resize(featureDimension * numClassify);
 		m_biases.resize(numClassify);
 		m_yHats.resize(numClassify);
@@ -35,7 +57,7 @@ public:
 	}
 
 public:
-	void miniBatch(const uint8_t* features, const uint8_t* labels, uint32_t batchSize, float eta)
+	void miniBatch(const Feature* features, const uint8_t* labels, uint32_t batchSize, float eta)
 	{
 		for (uint32_t i = 0; i < m_numClassify; ++i)
 		{
@@ -57,18 +79,11 @@ public:
 				m_sumBiasDerivates[i] += m_biasDerivates[i];
 			}
 		}
-		for (uint32_t i = 0; i < m_numClassify; ++i)
-		{
-			for (uint32_t j = 0; j < m_featureDimension; ++j)
-			{
-				float weightDerivate = m_sumWeightDerivates[i * m_featureDimension + j] / batchSize;
-				m_weights[i * m_featureDimension + j] -= weightDerivate * eta;
-			}
-			float biasDerivate = m_sumBiasDerivates[i] / batchSize;
-			m_biases[i] -= biasDerivate * eta;
-		}
+		float gradScale = 1.0f / batchSize;
+		m_optimizer->update(m_weights.data(), m_sumWeightDerivates.data(), m_weightState, m_weights.size(), gradScale, eta);
+		m_optimizer->update(m_biases.data(), m_sumBiasDerivates.data(), m_biasState, m_biases.size(), gradScale, eta);
 	}
-	void forward(const uint8_t* feature, uint8_t label)
+	void forward(const Feature* feature, uint8_t label)
 	{
 		if (softmax)
 		{
@@ -79,7 +94,7 @@ public:
 				float z = m_biases[i];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					z += feature[j] / 255.0f * weights[j];
+					z += FeatureValue(feature[j]) * weights[j];
 				}
 				float expz = exp(z);
 				m_yHats[i] = z;
@@ -93,7 +108,7 @@ public:
 				float* weightDerivates = &m_weightDerivates[i * m_featureDimension];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					weightDerivates[j] = zDerivate * feature[j] / 255.0f;
+					weightDerivates[j] = zDerivate * FeatureValue(feature[j]);
 				}
 				m_biasDerivates[i] = zDerivate;
 			}
@@ -106,7 +121,7 @@ public:
 				float z = m_biases[i];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					z += feature[j] / 255.0f * weights[j];
+					z += FeatureValue(feature[j]) * weights[j];
 				}
 				m_yHats[i] = sigmoid(z);
 
@@ -115,13 +130,13 @@ public:
 				float* weightDerivates = &m_weightDerivates[i * m_featureDimension];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					weightDerivates[j] = zDerivate * feature[j] / 255.0f;
+					weightDerivates[j] = zDerivate * FeatureValue(feature[j]);
 				}
 				m_biasDerivates[i] = zDerivate;
 			}
 		}
 	}
-	uint8_t evaluate(const uint8_t* feature)
+	uint8_t evaluate(const Feature* feature)
 	{
 		if (softmax)
 		{
@@ -131,7 +146,7 @@ public:
 				float z = m_biases[i];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					z += feature[j] / 255.0f * weights[j];
+					z += FeatureValue(feature[j]) * weights[j];
 				}
 				//float expz = exp(z);
 				m_yHats[i] = z;
@@ -145,7 +160,7 @@ public:
 				float z = m_biases[i];
 				for (uint32_t j = 0; j < m_featureDimension; ++j)
 				{
-					z += feature[j] / 255.0f * weights[j];
+					z += FeatureValue(feature[j]) * weights[j];
 				}
 				m_yHats[i] = sigmoid(z);
 			}
@@ -154,7 +169,7 @@ public:
 		return index;
 	}
 
-	float test(const uint8_t* features, const uint8_t* labels, uint32_t count)
+	float test(const Feature* features, const uint8_t* labels, uint32_t count)
 	{
 		uint32_t errorCount = 0;
 		for (uint32_t i = 0; i < count; ++i)
@@ -168,6 +183,12 @@ public:
 		}
 		return float(errorCount) / float(count);
 	}
+	//inputDimension is the raw pixel count when the features were projected from raw pixels
+	bool save(const std::string& fileName, uint32_t inputDimension = 0) const
+	{
+		CheckpointModel model = softmax ? CheckpointModel::SoftmaxRegression : CheckpointModel::SigmoidRegression;
+		return WriteCheckpoint(fileName, model, m_featureDimension, m_numClassify, m_weights.data(), m_biases.data(), inputDimension);
+	}
 public:
 	uint32_t m_featureDimension;
 	uint32_t m_numClassify;
@@ -178,12 +199,500 @@ public:
 	std::vector<float> m_biasDerivates;
 	std::vector<float> m_sumWeightDerivates;
 	std::vector<float> m_sumBiasDerivates;
+	Optimizer* m_optimizer;
+	OptimizerState m_weightState;
+	OptimizerState m_biasState;
 };
 
-int main()
+struct SweepModelConfig
+{
+	float learningRate;
+	float initScale;
+	uint32_t seed;
+	Optimizer* optimizer;
+};
+
+//K logistic regressions trained side by side: the weights of all models are stacked into one (K * numClassify) x featureDimension matrix,
+//so each batch is converted once and both the logits and the weight derivates of every model come out of one wide GEMM
+template<bool softmax = false>
+class LogisticRegressionSweep
+{
+public:
+	LogisticRegressionSweep(uint32_t featureDimension, uint32_t numClassify, const std::vector<SweepModelConfig>& configs)
+	{
+		m_featureDimension = featureDimension;
+		m_numClassify = numClassify;
+		m_configs = configs;
+		uint32_t numRows = numModels() * numClassify;
+		//the rows of every model are first touched by the worker that computes their logits and derivates
+		m_weights.allocateRows(numRows, featureDimension, numClassify);
+		m_biases.resize(numRows);
+		m_sumWeightDerivates.allocateRows(numRows, featureDimension, numClassify);
+		m_sumBiasDerivates.resize(numRows);
+		m_weightStates.resize(numModels());
+		m_biasStates.resize(numModels());
+		m_validationErrors.resize(numModels());
+		for (uint32_t k = 0; k < numModels(); ++k)
+		{
+			std::minstd_rand random(configs[k].seed);
+			std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+			float* weights = modelWeights(k);
+			for (uint32_t i = 0; i < numClassify * featureDimension; ++i)
+			{
+				weights[i] = uniform(random) * configs[k].initScale;
+			}
+			for (uint32_t i = 0; i < numClassify; ++i)
+			{
+				m_biases[k * numClassify + i] = uniform(random);
+			}
+		}
+	}
+
+public:
+	uint32_t numModels() const
+	{
+		return uint32_t(m_configs.size());
+	}
+	void miniBatch(const uint8_t* features, const uint8_t* labels, uint32_t batchSize)
+	{
+		uint32_t numRows = numModels() * m_numClassify;
+		logits(features, batchSize);
+		for (uint32_t b = 0; b < batchSize; ++b)
+		{
+			float* z = &m_logits[size_t(b) * numRows];
+			for (uint32_t k = 0; k < numModels(); ++k)
+			{
+				activate(z + k * m_numClassify);
+				z[k * m_numClassify + labels[b]] -= 1.0f;
+			}
+		}
+		//the logits now hold dLoss/dz for every model, so one GEMM produces all weight derivates
+		ParallelFor(numRows, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			Gemm(true, false, end - begin, m_featureDimension, batchSize, 1.0f, &m_logits[begin], numRows,
+				m_features.data(), m_featureDimension, 0.0f, m_sumWeightDerivates.writableData() + size_t(begin) * m_featureDimension, m_featureDimension);
+		}, m_numClassify);
+		std::fill(m_sumBiasDerivates.begin(), m_sumBiasDerivates.end(), 0.0f);
+		for (uint32_t b = 0; b < batchSize; ++b)
+		{
+			for (uint32_t r = 0; r < numRows; ++r)
+			{
+				m_sumBiasDerivates[r] += m_logits[size_t(b) * numRows + r];
+			}
+		}
+		float gradScale = 1.0f / batchSize;
+		ParallelFor(numModels(), [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			for (uint32_t k = begin; k < end; ++k)
+			{
+				const SweepModelConfig& config = m_configs[k];
+				uint32_t numWeights = m_numClassify * m_featureDimension;
+				config.optimizer->update(modelWeights(k), m_sumWeightDerivates.writableData() + size_t(k) * numWeights, m_weightStates[k], numWeights, gradScale, config.learningRate);
+				config.optimizer->update(&m_biases[k * m_numClassify], &m_sumBiasDerivates[k * m_numClassify], m_biasStates[k], m_numClassify, gradScale, config.learningRate);
+			}
+		});
+	}
+	//error rate of every model over count samples
+	std::vector<float> test(const uint8_t* features, const uint8_t* labels, uint32_t count, uint32_t batchSize = 256)
+	{
+		uint32_t numRows = numModels() * m_numClassify;
+		std::vector<uint32_t> errorCounts(numModels());
+		for (uint32_t begin = 0; begin < count; begin += batchSize)
+		{
+			uint32_t size = std::min(batchSize, count - begin);
+			logits(features + size_t(begin) * m_featureDimension, size);
+			for (uint32_t b = 0; b < size; ++b)
+			{
+				for (uint32_t k = 0; k < numModels(); ++k)
+				{
+					float* z = &m_logits[size_t(b) * numRows + k * m_numClassify];
+					if (std::max_element(z, z + m_numClassify) - z != labels[begin + b])
+					{
+						++errorCounts[k];
+					}
+				}
+			}
+		}
+		std::vector<float> errors(numModels());
+		for (uint32_t k = 0; k < numModels(); ++k)
+		{
+			errors[k] = float(errorCounts[k]) / float(count);
+		}
+		return errors;
+	}
+	void recordValidation(const uint8_t* features, const uint8_t* labels, uint32_t count)
+	{
+		std::vector<float> errors = test(features, labels, count);
+		for (uint32_t k = 0; k < numModels(); ++k)
+		{
+			m_validationErrors[k].push_back(errors[k]);
+		}
+	}
+private:
+	float* modelWeights(uint32_t k)
+	{
+		return m_weights.writableData() + size_t(k) * m_numClassify * m_featureDimension;
+	}
+	//m_logits[b][k * numClassify + i] = biases + features[b] . weights[k * numClassify + i] for every model
+	void logits(const uint8_t* features, uint32_t batchSize)
+	{
+		uint32_t numRows = numModels() * m_numClassify;
+		m_features.resize(size_t(batchSize) * m_featureDimension);
+		m_logits.resize(size_t(batchSize) * numRows);
+		for (size_t i = 0; i < m_features.size(); ++i)
+		{
+			m_features[i] = features[i] / 255.0f;
+		}
+		for (uint32_t b = 0; b < batchSize; ++b)
+		{
+			std::copy(m_biases.begin(), m_biases.end(), &m_logits[size_t(b) * numRows]);
+		}
+		ParallelFor(numRows, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			Gemm(false, true, batchSize, end - begin, m_featureDimension, 1.0f, m_features.data(), m_featureDimension,
+				m_weights.writableData() + size_t(begin) * m_featureDimension, m_featureDimension, 1.0f, &m_logits[begin], numRows);
+		}, m_numClassify);
+	}
+	//turns the logits of one model into yHats
+	void activate(float* z)
+	{
+		if (softmax)
+		{
+			float maxZ = *std::max_element(z, z + m_numClassify);
+			float sumExpZ = 0;
+			for (uint32_t i = 0; i < m_numClassify; ++i)
+			{
+				z[i] = exp(z[i] - maxZ);
+				sumExpZ += z[i];
+			}
+			for (uint32_t i = 0; i < m_numClassify; ++i)
+			{
+				z[i] /= sumExpZ;
+			}
+		}
+		else
+		{
+			for (uint32_t i = 0; i < m_numClassify; ++i)
+			{
+				z[i] = sigmoid(z[i]);
+			}
+		}
+	}
+public:
+	uint32_t m_featureDimension;
+	uint32_t m_numClassify;
+	std::vector<SweepModelConfig> m_configs;
+	NumaBuffer<float> m_weights;
+	std::vector<float> m_biases;
+	std::vector<float> m_features;
+	std::vector<float> m_logits;
+	NumaBuffer<float> m_sumWeightDerivates;
+	std::vector<float> m_sumBiasDerivates;
+	std::vector<OptimizerState> m_weightStates;
+	std::vector<OptimizerState> m_biasStates;
+	std::vector<std::vector<float>> m_validationErrors;
+};
+
+//comma separated list, e.g. "0.001,0.003"
+std::vector<std::string> SplitList(const std::string& list)
+{
+	std::vector<std::string> items;
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos)
+		{
+			end = list.size();
+		}
+		if (end > begin)
+		{
+			items.push_back(list.substr(begin, end - begin));
+		}
+		begin = end + 1;
+	}
+	return items;
+}
+
+Optimizer* CreateOptimizer(const std::string& name)
+{
+	if (name == "sgd")
+	{
+		return new SgdOptimizer();
+	}
+	if (name == "momentum")
+	{
+		return new MomentumOptimizer(0.9f, false);
+	}
+	if (name == "nesterov")
+	{
+		return new MomentumOptimizer(0.9f, true);
+	}
+	if (name == "adam")
+	{
+		return new AdamOptimizer();
+	}
+	if (name == "adamw")
+	{
+		return new AdamOptimizer(0.9f, 0.999f, 1e-8f, 0.01f);
+	}
+	return nullptr;
+}
+
+//trains numModels() stacked models for epoch passes and returns the wall time
+double TrainSweep(LogisticRegressionSweep<true>& models, const uint8_t* trainImages, const uint8_t* trainLabels, const uint8_t* validationImages,
+	const uint8_t* validationLabels, uint32_t featureDimension, uint32_t trainCount, uint32_t validationCount, uint32_t batchSize, uint32_t epoch)
+{
+	uint32_t numBatch = trainCount / batchSize;
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t e = 0; e < epoch; ++e)
+	{
+		for (uint32_t b = 0; b < numBatch; ++b)
+		{
+			models.miniBatch(trainImages + size_t(b) * batchSize * featureDimension, trainLabels + b * batchSize, batchSize);
+		}
+		models.recordValidation(validationImages, validationLabels, validationCount);
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+//regression sweep [optimizers] [etas] [inits] [epochs]: trains the full optimizer x eta x initScale grid as one stacked model,
+//e.g. regression sweep sgd,adam 0.001,0.003,0.01 0.3,0.01 10
+void sweep(const std::vector<uint8_t>& trainImages, const std::vector<uint8_t>& trainLabels, uint32_t featureDimension, uint32_t trainCount,
+	uint32_t validationCount, int argc, char** argv)
+{
+	std::vector<std::string> optimizerNames = SplitList(argc > 2 ? argv[2] : "sgd,adam");
+	std::vector<std::string> etas = SplitList(argc > 3 ? argv[3] : "0.0003,0.001,0.003,0.01");
+	std::vector<std::string> initScales = SplitList(argc > 4 ? argv[4] : "0.3,0.01");
+	uint32_t epoch = argc > 5 ? uint32_t(atoi(argv[5])) : 10;
+
+	std::vector<std::unique_ptr<Optimizer>> optimizers;
+	std::vector<SweepModelConfig> configs;
+	std::vector<std::string> names;
+	for (const std::string& optimizerName : optimizerNames)
+	{
+		Optimizer* optimizer = CreateOptimizer(optimizerName);
+		if (!optimizer)
+		{
+			printf("unknown optimizer %s, expected sgd, momentum, nesterov, adam or adamw\n", optimizerName.c_str());
+			return;
+		}
+		optimizers.emplace_back(optimizer);
+		for (const std::string& initScale : initScales)
+		{
+			for (const std::string& eta : etas)
+			{
+				configs.push_back({ float(atof(eta.c_str())), float(atof(initScale.c_str())), uint32_t(configs.size() + 1), optimizer });
+				names.push_back(optimizerName);
+			}
+		}
+	}
+	if (configs.empty() || epoch == 0)
+	{
+		printf("empty sweep grid\n");
+		return;
+	}
+
+	uint32_t batchSize = 10;
+	uint64_t samples = uint64_t(trainCount / batchSize) * batchSize;
+	//the images are interleaved over the nodes instead of sitting on the node that read the files
+	NumaBuffer<uint8_t> images(NumaPlacement::Interleave);
+	images.assign(trainImages.data(), size_t(trainCount + validationCount) * featureDimension);
+	const uint8_t* validationImages = images.data() + size_t(trainCount) * featureDimension;
+	const uint8_t* validationLabels = trainLabels.data() + trainCount;
+
+	//one epoch of the first model alone, the reference for how the stacked grid scales in K
+	LogisticRegressionSweep<true> single(featureDimension, 10, { configs[0] });
+	double singleSeconds = TrainSweep(single, images.data(), trainLabels.data(), validationImages, validationLabels,
+		featureDimension, trainCount, validationCount, batchSize, 1);
+
+	LogisticRegressionSweep<true> models(featureDimension, 10, configs);
+	double seconds = TrainSweep(models, images.data(), trainLabels.data(), validationImages, validationLabels,
+		featureDimension, trainCount, validationCount, batchSize, epoch);
+
+	for (uint32_t k = 0; k < models.numModels(); ++k)
+	{
+		const SweepModelConfig& config = configs[k];
+		printf("model %u: %s eta %g init %g, validation error", k, names[k].c_str(), config.learningRate, config.initScale);
+		for (float error : models.m_validationErrors[k])
+		{
+			printf(" %.2f", error * 100);
+		}
+		printf("\n");
+	}
+	double singleThroughput = samples / singleSeconds;
+	double throughput = double(models.numModels()) * epoch * samples / seconds;
+	printf("K=1: %.2fs/epoch, %.0f model-samples/s\n", singleSeconds, singleThroughput);
+	printf("K=%u: %.2fs/epoch, %.0f model-samples/s, %.2fx the K=1 throughput\n", models.numModels(), seconds / epoch, throughput,
+		throughput / singleThroughput);
+}
+
+//trains the same softmax regression on raw pixels or on projected features and reports the wall time, projection included,
+//until the validation error first reaches targetError or epoch passes are done; the model is saved to checkpointName unless it is empty,
+//marked as taking features projected from inputDimension pixels when that is not 0
+template<typename Feature>
+void trainToTarget(const char* name, Optimizer* optimizer, float eta, uint32_t epoch, const Feature* trainFeatures, const Feature* validationFeatures,
+	const uint8_t* trainLabels, const uint8_t* validationLabels, uint32_t featureDimension, uint32_t trainCount, uint32_t validationCount,
+	double prepareSeconds, float targetError, const std::string& checkpointName = std::string(), uint32_t inputDimension = 0)
+{
+	srand(1);
+	LogisticRegression<true, Feature> logisticRegression(featureDimension, 10, optimizer);
+	uint32_t batchSize = 10;
+	uint32_t numBatch = trainCount / batchSize;
+	double trainSeconds = 0;
+	float error = 1;
+	uint32_t e = 0;
+	while (e < epoch && error > targetError)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		for (uint32_t b = 0; b < numBatch; ++b)
+		{
+			logisticRegression.miniBatch(trainFeatures + size_t(b) * batchSize * featureDimension, trainLabels + b * batchSize, batchSize, eta);
+		}
+		trainSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		error = logisticRegression.test(validationFeatures, validationLabels, validationCount);
+		++e;
+	}
+	printf("%-8s %4u dims: prepare %.2fs, %.2fs/epoch, validation error %.2f%% after %u epochs, %.2fs%s\n", name, featureDimension,
+		prepareSeconds, trainSeconds / e, error * 100, e, prepareSeconds + trainSeconds, error > targetError ? " (target not reached)" : "");
+	if (!checkpointName.empty())
+	{
+		logisticRegression.save(checkpointName, inputDimension);
+	}
+}
+
+//time-to-target-error of the raw-pixel path against pca and sparse random projections fitted on the training split
+void project(const std::vector<uint8_t>& trainImages, const std::vector<uint8_t>& trainLabels, uint32_t featureDimension,
+	uint32_t trainCount, uint32_t validationCount, const std::string& path)
+{
+	const float targetError = 0.09f;
+	const uint8_t* validationImages = trainImages.data() + size_t(trainCount) * featureDimension;
+	const uint8_t* validationLabels = trainLabels.data() + trainCount;
+	AdamOptimizer optimizer;
+	trainToTarget("raw", &optimizer, 0.001f, 10, trainImages.data(), validationImages, trainLabels.data(), validationLabels,
+		featureDimension, trainCount, validationCount, 0.0, targetError);
+
+	struct ProjectionConfig
+	{
+		const char* name;
+		bool pca;
+		uint32_t outputDimension;
+	};
+	const ProjectionConfig configs[] = { { "pca", true, 50 }, { "pca", true, 100 }, { "random", false, 100 } };
+	for (const ProjectionConfig& config : configs)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		Projection projection;
+		if (config.pca)
+		{
+			projection.fitPca(trainImages.data(), trainCount, featureDimension, config.outputDimension);
+		}
+		else
+		{
+			projection.fitRandom(trainImages.data(), trainCount, featureDimension, config.outputDimension);
+		}
+		double fitSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		std::vector<float> features = projection.transform(trainImages.data(), trainCount + validationCount);
+		double prepareSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		if (config.pca)
+		{
+			printf("%s %u: fit %.2fs, transform %.2fs, %.1f%% of the variance kept\n", config.name, config.outputDimension,
+				fitSeconds, prepareSeconds - fitSeconds, projection.explainedVariance() * 100);
+		}
+		else
+		{
+			printf("%s %u: fit %.2fs, transform %.2fs\n", config.name, config.outputDimension, fitSeconds, prepareSeconds - fitSeconds);
+		}
+		//the projection and the model trained on it are saved side by side, "regression predict" applies them together
+		std::string name = path + "/data/" + config.name + std::to_string(config.outputDimension);
+		trainToTarget(config.name, &optimizer, 0.001f, 10, features.data(), features.data() + size_t(trainCount) * projection.outputDimension(), trainLabels.data(),
+			validationLabels, projection.outputDimension(), trainCount, validationCount, prepareSeconds, targetError, name + ".ckpt", featureDimension);
+		projection.save(name + ".idx2-float");
+	}
+}
+
+//regression optimizers [targetErrorPercent]: epochs-to-target of the raw-pixel softmax regression per optimizer,
+//each at its best step size from the sweep, batch 10 and at most 40 epochs
+void compareOptimizers(const std::vector<uint8_t>& trainImages, const std::vector<uint8_t>& trainLabels, uint32_t featureDimension,
+	uint32_t trainCount, uint32_t validationCount, float targetError)
+{
+	struct OptimizerConfig
+	{
+		const char* name;
+		float eta;
+	};
+	const OptimizerConfig configs[] = { { "sgd", 0.003f }, { "momentum", 0.003f }, { "nesterov", 0.003f }, { "adam", 0.001f } };
+	for (const OptimizerConfig& config : configs)
+	{
+		std::unique_ptr<Optimizer> optimizer(CreateOptimizer(config.name));
+		trainToTarget(config.name, optimizer.get(), config.eta, 40, trainImages.data(), trainImages.data() + size_t(trainCount) * featureDimension,
+			trainLabels.data(), trainLabels.data() + trainCount, featureDimension, trainCount, validationCount, 0.0, targetError);
+	}
+}
+
+//regression predict [checkpoint] [projection]: scores the test set with a saved model, through the saved projection when one is given
+void predict(const std::vector<uint8_t>& testImages, const std::vector<uint8_t>& testLabels, uint32_t featureDimension, uint32_t testCount,
+	const std::string& checkpointName, const std::string& projectionName)
+{
+	MappedCheckpoint checkpoint;
+	if (!checkpoint.open(checkpointName))
+	{
+		printf("can not map checkpoint %s\n", checkpointName.c_str());
+		return;
+	}
+	std::vector<uint8_t> predictions(testCount);
+	if (projectionName.empty())
+	{
+		if (checkpoint.projected())
+		{
+			printf("%s takes features projected from %u pixels, pass its projection\n", checkpointName.c_str(), checkpoint.header().inputDimension);
+			return;
+		}
+		if (checkpoint.header().featureDimension != featureDimension)
+		{
+			printf("%s expects %u features, the images have %u\n", checkpointName.c_str(), checkpoint.header().featureDimension, featureDimension);
+			return;
+		}
+		checkpoint.predict(testImages.data(), testCount, predictions.data());
+	}
+	else
+	{
+		Projection projection;
+		if (!projection.load(projectionName) || projection.inputDimension() != featureDimension
+			|| projection.outputDimension() != checkpoint.header().featureDimension
+			|| (checkpoint.projected() && checkpoint.header().inputDimension != featureDimension))
+		{
+			printf("%s does not map %u pixels to the %u features of %s\n", projectionName.c_str(), featureDimension,
+				checkpoint.header().featureDimension, checkpointName.c_str());
+			return;
+		}
+		std::vector<float> features = projection.transform(testImages.data(), testCount);
+		checkpoint.predict(features.data(), testCount, predictions.data());
+	}
+	uint32_t errorCount = 0;
+	for (uint32_t i = 0; i < testCount; ++i)
+	{
+		if (predictions[i] != testLabels[i])
+		{
+			++errorCount;
+		}
+	}
+	printf("%s: test error %f\n", checkpointName.c_str(), float(errorCount) / float(testCount) * 100);
+}
+
+int main(int argc, char** argv)
 {
 	std::string path = CMAKE_SOURCE_DIR;
 
+	//needs no dataset; the workers are pinned, otherwise nothing ties a worker to the node whose replica it reads
+	if (argc > 1 && std::string(argv[1]) == "numa")
+	{
+		ThreadPool pool(ThreadPool::EnvThreads(), AffinityPolicy::Scatter);
+		printf("%u threads on %u numa nodes\n", pool.numThreads(), pool.numNodes());
+		PrintNumaBandwidth(MeasureNumaBandwidth(pool));
+		return 0;
+	}
+
 	MnistImageHeader trainImageHeader;
 	MnistLabelHeader trainLabelHeader;
 	MnistImageHeader testImageHeader;
@@ -206,6 +715,28 @@ int main()
 	uint32_t trainCount = trainImageHeader.imageCount - validationCount;
 	uint32_t testCount = testImageHeader.imageCount;
 
+	if (argc > 1 && std::string(argv[1]) == "sweep")
+	{
+		sweep(trainImages, trainLabels, featureDimension, trainCount, validationCount, argc, argv);
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == "predict")
+	{
+		predict(testImages, testLabels, featureDimension, testCount, argc > 2 ? argv[2] : path + "/data/regression.ckpt", argc > 3 ? argv[3] : "");
+		return 0;
+	}
+	if (argc > 1 && std::string(argv[1]) == "project")
+	{
+		project(trainImages, trainLabels, featureDimension, trainCount, validationCount, path);
+		return 0;
+	}
+
+	if (argc > 1 && std::string(argv[1]) == "optimizers")
+	{
+		compareOptimizers(trainImages, trainLabels, featureDimension, trainCount, validationCount, argc > 2 ? float(atof(argv[2])) / 100 : 0.08f);
+		return 0;
+	}
+
 	LogisticRegression<true> logisticRegression(featureDimension, 10);
 
 	uint32_t batchSize = 10;
@@ -243,6 +774,8 @@ int main()
 			logisticRegression.test(testImages.data(), testLabels.data(), testCount) * 100);
 	}
 
+	logisticRegression.save(path + "/data/regression.ckpt");
+
 	std::unordered_map<uint32_t, uint32_t> errors;
 
 	for (uint32_t i = 0; i < testImageHeader.imageCount; ++i)
@@ -0,0 +1,438 @@
+﻿//local inference daemon: clients send one 28 x 28 image of raw pixel bytes per request over a unix domain socket and get one label byte back.
+//concurrent requests are coalesced into micro-batches that are scored together once the batch is full or the oldest request hits its deadline
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+typedef SOCKET Socket;
+const Socket invalid_socket = INVALID_SOCKET;
+#define CloseSocket closesocket
+#define send_flags 0
+#define shutdown_both SD_BOTH
+#define SocketError() WSAGetLastError()
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int Socket;
+const Socket invalid_socket = -1;
+#define CloseSocket close
+#define send_flags MSG_NOSIGNAL
+#define shutdown_both SHUT_RDWR
+#define SocketError() errno
+#endif
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include "../mnist.h"
+#include "../checkpoint.h"
+#include "../projection.h"
+
+typedef std::chrono::steady_clock Clock;
+
+//bytes per request, one 28 x 28 mnist image
+const uint32_t image_size = 28 * 28;
+//a client pipelining further ahead than this is not read from until its replies drain
+const uint32_t max_pending_replies = 4096;
+
+bool ReadFull(Socket socket, void* data, size_t size)
+{
+	char* bytes = (char*)data;
+	while (size > 0)
+	{
+		int received = recv(socket, bytes, int(size), 0);
+		if (received <= 0)
+		{
+			return false;
+		}
+		bytes += received;
+		size -= received;
+	}
+	return true;
+}
+
+bool WriteFull(Socket socket, const void* data, size_t size)
+{
+	const char* bytes = (const char*)data;
+	while (size > 0)
+	{
+		int sent = send(socket, bytes, int(size), send_flags);
+		if (sent <= 0)
+		{
+			return false;
+		}
+		bytes += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+//fails on paths that do not fit sun_path instead of binding or connecting to a truncated one
+bool UnixAddress(const std::string& socketName, sockaddr_un& address)
+{
+	address = {};
+	address.sun_family = AF_UNIX;
+	if (socketName.size() >= sizeof(address.sun_path))
+	{
+		printf("socket path %s is %zu bytes, at most %zu fit\n", socketName.c_str(), socketName.size(), sizeof(address.sun_path) - 1);
+		return false;
+	}
+	memcpy(address.sun_path, socketName.c_str(), socketName.size() + 1);
+	return true;
+}
+
+//served by one reader and one writer thread; the batcher only queues replies here, so a client that stops reading
+//stalls nobody but itself. closed once the reader is gone and the writer has sent the last pending reply
+struct Connection
+{
+	Socket socket;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::vector<uint8_t> replies;
+	uint32_t pending;//requests read but not yet written back
+	bool readerDone;
+	bool writerFailed;
+public:
+	Connection(Socket s) :
+		socket(s),
+		pending(0),
+		readerDone(false),
+		writerFailed(false)
+	{}
+	~Connection()
+	{
+		CloseSocket(socket);
+	}
+	void reply(uint8_t prediction)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			replies.push_back(prediction);
+		}
+		changed.notify_all();
+	}
+};
+
+struct Request
+{
+	std::shared_ptr<Connection> connection;
+	Clock::time_point arrival;
+};
+
+class InferenceServer
+{
+public:
+	//with a projection the clients still send raw pixels, which are projected before they reach the model
+	InferenceServer(const MappedCheckpoint& checkpoint, const Projection* projection, uint32_t maxBatch, std::chrono::microseconds maxDelay) :
+		m_checkpoint(checkpoint),
+		m_projection(projection),
+		m_featureDimension(projection ? projection->inputDimension() : checkpoint.header().featureDimension),
+		m_maxBatch(maxBatch),
+		m_maxDelay(maxDelay)
+	{}
+public:
+	void run(const std::string& socketName)
+	{
+		sockaddr_un address;
+		if (!UnixAddress(socketName, address))
+		{
+			return;
+		}
+		Socket listener = socket(AF_UNIX, SOCK_STREAM, 0);
+#ifdef _WIN32
+		DeleteFileA(socketName.c_str());
+#else
+		unlink(socketName.c_str());
+#endif
+		if (listener == invalid_socket || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0)
+		{
+			printf("can not listen on %s\n", socketName.c_str());
+			return;
+		}
+		printf("serving %u x %u model on %s, batch %u, deadline %lldus\n", m_checkpoint.header().numClassify, m_featureDimension,
+			socketName.c_str(), m_maxBatch, (long long)m_maxDelay.count());
+		fflush(stdout);
+		std::thread batcher(&InferenceServer::batchLoop, this);
+		while (true)
+		{
+			Socket client = accept(listener, nullptr, nullptr);
+			if (client == invalid_socket)
+			{
+				//out of descriptors or memory mostly, which retrying at once does not fix
+				printf("accept failed with error %d\n", SocketError());
+				fflush(stdout);
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				continue;
+			}
+			std::shared_ptr<Connection> connection = std::make_shared<Connection>(client);
+			std::thread(&InferenceServer::readLoop, this, connection).detach();
+			std::thread(&InferenceServer::writeLoop, this, connection).detach();
+		}
+	}
+private:
+	void readLoop(std::shared_ptr<Connection> connection)
+	{
+		std::vector<uint8_t> features(m_featureDimension);
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(connection->mutex);
+				connection->changed.wait(lock, [&] { return connection->pending < max_pending_replies || connection->writerFailed; });
+				if (connection->writerFailed)
+				{
+					break;
+				}
+			}
+			if (!ReadFull(connection->socket, features.data(), features.size()))
+			{
+				break;
+			}
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				++connection->pending;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_requests.push_back(Request{ connection, Clock::now() });
+			m_features.insert(m_features.end(), features.begin(), features.end());
+			if (m_requests.size() == 1 || m_requests.size() >= m_maxBatch)
+			{
+				m_ready.notify_one();
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(connection->mutex);
+			connection->readerDone = true;
+		}
+		connection->changed.notify_all();
+	}
+	//sends the queued replies in order; a failed send shuts the socket down, which also ends the reader
+	void writeLoop(std::shared_ptr<Connection> connection)
+	{
+		std::vector<uint8_t> replies;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(connection->mutex);
+				connection->changed.wait(lock, [&] { return !connection->replies.empty() || (connection->readerDone && connection->pending == 0); });
+				if (connection->replies.empty())
+				{
+					return;
+				}
+				replies.swap(connection->replies);
+			}
+			bool sent = WriteFull(connection->socket, replies.data(), replies.size());
+			{
+				std::lock_guard<std::mutex> lock(connection->mutex);
+				connection->pending -= uint32_t(replies.size());
+				connection->writerFailed = !sent;
+			}
+			connection->changed.notify_all();
+			if (!sent)
+			{
+				shutdown(connection->socket, shutdown_both);
+				return;
+			}
+			replies.clear();
+		}
+	}
+	//waits for a first request, then until the batch is full or that request's deadline has passed; replies go to the writer threads
+	void batchLoop()
+	{
+		std::vector<Request> requests;
+		std::vector<uint8_t> features;
+		std::vector<uint8_t> predictions;
+		std::vector<float> projected;
+		std::vector<double> latencies;
+		uint64_t numBatches = 0;
+		Clock::time_point reportTime = Clock::now();
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_ready.wait(lock, [&] { return !m_requests.empty(); });
+				Clock::time_point deadline = m_requests.front().arrival + m_maxDelay;
+				m_ready.wait_until(lock, deadline, [&] { return m_requests.size() >= m_maxBatch; });
+				requests.swap(m_requests);
+				features.swap(m_features);
+				m_requests.clear();
+				m_features.clear();
+			}
+			predictions.resize(requests.size());
+			for (uint32_t begin = 0; begin < requests.size(); begin += m_maxBatch)
+			{
+				uint32_t count = std::min(m_maxBatch, uint32_t(requests.size()) - begin);
+				if (m_projection)
+				{
+					projected.resize(size_t(count) * m_projection->outputDimension());
+					m_projection->transform(&features[size_t(begin) * m_featureDimension], count, projected.data());
+					m_checkpoint.predict(projected.data(), count, &predictions[begin]);
+				}
+				else
+				{
+					m_checkpoint.predict(&features[size_t(begin) * m_featureDimension], count, &predictions[begin]);
+				}
+				++numBatches;
+			}
+			Clock::time_point now = Clock::now();
+			for (size_t i = 0; i < requests.size(); ++i)
+			{
+				requests[i].connection->reply(predictions[i]);
+				latencies.push_back(std::chrono::duration<double, std::micro>(now - requests[i].arrival).count());
+			}
+			requests.clear();
+			double seconds = std::chrono::duration<double>(now - reportTime).count();
+			if (seconds >= 5.0)
+			{
+				std::sort(latencies.begin(), latencies.end());
+				printf("%.0f requests/s, mean batch %.1f, server p50 %.0fus, p99 %.0fus\n", latencies.size() / seconds,
+					double(latencies.size()) / numBatches, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+				fflush(stdout);
+				latencies.clear();
+				numBatches = 0;
+				reportTime = now;
+			}
+		}
+	}
+private:
+	const MappedCheckpoint& m_checkpoint;
+	const Projection* m_projection;
+	uint32_t m_featureDimension;
+	uint32_t m_maxBatch;
+	std::chrono::microseconds m_maxDelay;
+	std::mutex m_mutex;
+	std::condition_variable m_ready;
+	std::vector<Request> m_requests;
+	std::vector<uint8_t> m_features;
+};
+
+//closed-loop load: every client keeps exactly one request in flight
+void bench(const std::string& socketName, const std::vector<uint8_t>& images, const std::vector<uint8_t>& labels,
+	uint32_t featureDimension, uint32_t numClients, uint32_t requestsPerClient)
+{
+	sockaddr_un address;
+	if (!UnixAddress(socketName, address))
+	{
+		return;
+	}
+	uint32_t imageCount = uint32_t(images.size() / featureDimension);
+	std::vector<std::vector<double>> latencies(numClients);
+	std::atomic<uint32_t> correctCount(0);
+	std::atomic<uint32_t> failedClients(0);
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> clients;
+	for (uint32_t c = 0; c < numClients; ++c)
+	{
+		clients.emplace_back([&, c]()
+		{
+			Socket client = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (client == invalid_socket || connect(client, (sockaddr*)&address, sizeof(address)) != 0)
+			{
+				++failedClients;
+				return;
+			}
+			for (uint32_t r = 0; r < requestsPerClient; ++r)
+			{
+				uint32_t index = (c * requestsPerClient + r) % imageCount;
+				uint8_t prediction;
+				Clock::time_point sent = Clock::now();
+				if (!WriteFull(client, &images[size_t(index) * featureDimension], featureDimension) || !ReadFull(client, &prediction, 1))
+				{
+					++failedClients;
+					break;
+				}
+				latencies[c].push_back(std::chrono::duration<double, std::micro>(Clock::now() - sent).count());
+				if (!labels.empty() && prediction == labels[index])
+				{
+					++correctCount;
+				}
+			}
+			CloseSocket(client);
+		});
+	}
+	for (auto& client : clients)
+	{
+		client.join();
+	}
+	double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::vector<double> all;
+	for (auto& clientLatencies : latencies)
+	{
+		all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+	}
+	if (all.empty())
+	{
+		printf("no request completed, is the daemon running on %s?\n", socketName.c_str());
+		return;
+	}
+	std::sort(all.begin(), all.end());
+	printf("%u clients, %zu requests in %.2fs: %.0f requests/s, p50 %.0fus, p99 %.0fus", numClients, all.size(), seconds,
+		all.size() / seconds, all[all.size() / 2], all[all.size() * 99 / 100]);
+	if (!labels.empty())
+	{
+		printf(", error %f", (1.0 - double(correctCount) / all.size()) * 100);
+	}
+	printf("%s\n", failedClients ? ", some clients failed" : "");
+}
+
+//serve daemon [checkpoint] [socket] [maxBatch] [maxDelayUs] [projection]
+//serve bench [socket] [clients] [requestsPerClient]
+int main(int argc, char** argv)
+{
+	std::string path = CMAKE_SOURCE_DIR;
+	std::string mode = argc > 1 ? argv[1] : "daemon";
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	if (mode == "daemon")
+	{
+		std::string checkpointName = argc > 2 ? argv[2] : path + "/data/regression.ckpt";
+		std::string socketName = argc > 3 ? argv[3] : path + "/data/mnist.sock";
+		uint32_t maxBatch = argc > 4 ? atoi(argv[4]) : 64;
+		uint32_t maxDelay = argc > 5 ? atoi(argv[5]) : 200;
+		MappedCheckpoint checkpoint;
+		if (!checkpoint.open(checkpointName))
+		{
+			printf("can not map checkpoint %s\n", checkpointName.c_str());
+			return 0;
+		}
+		Projection projection;
+		if (argc > 6 && (!projection.load(argv[6]) || projection.inputDimension() != image_size
+			|| projection.outputDimension() != checkpoint.header().featureDimension
+			|| (checkpoint.projected() && checkpoint.header().inputDimension != image_size)))
+		{
+			printf("%s does not map %u pixels to the %u features of %s\n", argv[6], image_size, checkpoint.header().featureDimension, checkpointName.c_str());
+			return 0;
+		}
+		if (argc <= 6 && (checkpoint.projected() || checkpoint.header().featureDimension != image_size))
+		{
+			printf("%s takes %u features, not %u pixels, pass its projection\n", checkpointName.c_str(), checkpoint.header().featureDimension, image_size);
+			return 0;
+		}
+		InferenceServer server(checkpoint, argc > 6 ? &projection : nullptr, std::max(1u, maxBatch), std::chrono::microseconds(maxDelay));
+		server.run(socketName);
+	}
+	else if (mode == "bench")
+	{
+		std::string socketName = argc > 2 ? argv[2] : path + "/data/mnist.sock";
+		uint32_t numClients = argc > 3 ? atoi(argv[3]) : 16;
+		uint32_t requestsPerClient = argc > 4 ? atoi(argv[4]) : 2000;
+		MnistImageHeader imageHeader = {};
+		MnistLabelHeader labelHeader;
+		std::vector<uint8_t> images;
+		std::vector<uint8_t> labels;
+		if (!ReadImageData(imageHeader, images, path + "/data/t10k-images.idx3-ubyte") ||
+			!ReadLabelData(labelHeader, labels, path + "/data/t10k-labels.idx1-ubyte"))
+		{
+			return 0;
+		}
+		bench(socketName, images, labels, imageHeader.rowCount * imageHeader.columnCount, numClients, requestsPerClient);
+	}
+}
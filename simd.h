@@ -0,0 +1,15 @@
+#pragma once
+
+//SSE2 is part of the x64 baseline, so every 64-bit build gets the vector paths; 32-bit MSVC needs /arch:SSE2.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MNIST_SSE2 1
+#include <emmintrin.h>
+#else
+#define MNIST_SSE2 0
+#endif
+
+#if defined(_MSC_VER)
+#define MNIST_RESTRICT __restrict
+#else
+#define MNIST_RESTRICT __restrict__
+#endif
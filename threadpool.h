@@ -0,0 +1,717 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+//cpus of every numa node the process may run on (taskset, cpusets and container limits are honoured), nodes left without
+//an allowed cpu are dropped; a machine without numa information is one node holding all allowed cpus
+struct NumaTopology
+{
+	std::vector<std::vector<uint32_t>> nodeCpus;
+public:
+	uint32_t numNodes() const
+	{
+		return uint32_t(nodeCpus.size());
+	}
+	static const NumaTopology& GetInstance()
+	{
+		static NumaTopology s_instance = Detect();
+		return s_instance;
+	}
+private:
+	static NumaTopology Detect()
+	{
+		NumaTopology topology;
+		std::vector<uint32_t> allowed = AllowedCpus();
+#ifdef _WIN32
+		ULONG highestNode = 0;
+		if (GetNumaHighestNodeNumber(&highestNode))
+		{
+			for (ULONG node = 0; node <= highestNode; ++node)
+			{
+				ULONGLONG mask = 0;
+				if (!GetNumaNodeProcessorMask(UCHAR(node), &mask) || mask == 0)
+				{
+					continue;
+				}
+				std::vector<uint32_t> cpus;
+				for (uint32_t cpu = 0; cpu < 64; ++cpu)
+				{
+					if (mask & (ULONGLONG(1) << cpu))
+					{
+						cpus.push_back(cpu);
+					}
+				}
+				cpus = Intersect(cpus, allowed);
+				if (!cpus.empty())
+				{
+					topology.nodeCpus.push_back(cpus);
+				}
+			}
+		}
+#else
+		for (uint32_t node = 0; node < 256; ++node)
+		{
+			std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string cpuList;
+			if (!file.is_open() || !std::getline(file, cpuList))
+			{
+				continue;
+			}
+			std::vector<uint32_t> cpus = Intersect(ParseCpuList(cpuList), allowed);
+			if (!cpus.empty())
+			{
+				topology.nodeCpus.push_back(cpus);
+			}
+		}
+#endif
+		if (topology.nodeCpus.empty())
+		{
+			topology.nodeCpus.push_back(allowed);
+		}
+		return topology;
+	}
+	//cpus in the affinity mask of the process, every cpu when the mask cannot be read
+	static std::vector<uint32_t> AllowedCpus()
+	{
+		std::vector<uint32_t> cpus;
+#ifdef _WIN32
+		DWORD_PTR processMask = 0;
+		DWORD_PTR systemMask = 0;
+		if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+		{
+			for (uint32_t cpu = 0; cpu < sizeof(DWORD_PTR) * 8; ++cpu)
+			{
+				if (processMask & (DWORD_PTR(1) << cpu))
+				{
+					cpus.push_back(cpu);
+				}
+			}
+		}
+#else
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0)
+		{
+			for (uint32_t cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &cpuSet))
+				{
+					cpus.push_back(cpu);
+				}
+			}
+		}
+#endif
+		if (cpus.empty())
+		{
+			for (uint32_t cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		return cpus;
+	}
+	static std::vector<uint32_t> Intersect(const std::vector<uint32_t>& cpus, const std::vector<uint32_t>& allowed)
+	{
+		std::vector<uint32_t> result;
+		for (uint32_t cpu : cpus)
+		{
+			if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+			{
+				result.push_back(cpu);
+			}
+		}
+		return result;
+	}
+	//"0-3,8-11" -> 0 1 2 3 8 9 10 11
+	static std::vector<uint32_t> ParseCpuList(const std::string& cpuList)
+	{
+		std::vector<uint32_t> cpus;
+		std::stringstream stream(cpuList);
+		std::string range;
+		while (std::getline(stream, range, ','))
+		{
+			if (range.empty() || range[0] < '0' || range[0] > '9')
+			{
+				continue;
+			}
+			size_t dash = range.find('-');
+			uint32_t first = uint32_t(std::stoul(range.substr(0, dash)));
+			uint32_t last = dash == std::string::npos ? first : uint32_t(std::stoul(range.substr(dash + 1)));
+			for (uint32_t cpu = first; cpu <= last; ++cpu)
+			{
+				cpus.push_back(cpu);
+			}
+		}
+		return cpus;
+	}
+};
+
+enum class AffinityPolicy
+{
+	None,//let the os place the workers; the pool then reports a single node, as nothing keeps a worker on one
+	Compact,//fill the cpus of node 0 first, then node 1, ...
+	Scatter,//round-robin the workers over the nodes
+};
+
+//work-stealing pool: every worker owns a deque, pops its own tasks from the back and steals from the front of the others.
+//the thread calling parallelFor helps instead of blocking, so it counts as one more thread with index numWorkers()
+class ThreadPool
+{
+public:
+	//numThreads counts the calling thread, 0 means one per allowed cpu
+	ThreadPool(uint32_t numThreads = 0, AffinityPolicy affinity = AffinityPolicy::None) :
+		m_queued(0),
+		m_stop(false)
+	{
+		const NumaTopology& topology = NumaTopology::GetInstance();
+		std::vector<std::pair<uint32_t, uint32_t>> cpus;//cpu, node
+		if (affinity == AffinityPolicy::Scatter)
+		{
+			for (size_t i = 0; cpus.size() < TotalCpus(topology); ++i)
+			{
+				for (uint32_t node = 0; node < topology.numNodes(); ++node)
+				{
+					if (i < topology.nodeCpus[node].size())
+					{
+						cpus.push_back(std::make_pair(topology.nodeCpus[node][i], node));
+					}
+				}
+			}
+		}
+		else
+		{
+			for (uint32_t node = 0; node < topology.numNodes(); ++node)
+			{
+				for (uint32_t cpu : topology.nodeCpus[node])
+				{
+					cpus.push_back(std::make_pair(cpu, affinity == AffinityPolicy::None ? 0 : node));
+				}
+			}
+		}
+		if (numThreads == 0)
+		{
+			numThreads = uint32_t(cpus.size());
+		}
+		m_nodeWorkerCounts.resize(affinity == AffinityPolicy::None ? 1 : topology.numNodes());
+		//the first cpu is left to the calling thread
+		for (uint32_t w = 0; w + 1 < numThreads; ++w)
+		{
+			const std::pair<uint32_t, uint32_t>& cpu = cpus[(w + 1) % cpus.size()];
+			Worker* worker = new Worker();
+			worker->node = cpu.second;
+			worker->nodeRank = m_nodeWorkerCounts[cpu.second]++;
+			m_workers.emplace_back(worker);
+		}
+		for (uint32_t w = 0; w < numWorkers(); ++w)
+		{
+			m_workers[w]->thread = std::thread(&ThreadPool::workerLoop, this, w);
+			if (affinity != AffinityPolicy::None && !PinThread(m_workers[w]->thread, cpus[(w + 1) % cpus.size()].first))
+			{
+				fprintf(stderr, "thread pool: cannot pin worker %u to cpu %u, it runs unpinned\n", w, cpus[(w + 1) % cpus.size()].first);
+			}
+		}
+	}
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			m_stop = true;
+		}
+		m_wakeUp.notify_all();
+		for (auto& worker : m_workers)
+		{
+			worker->thread.join();
+		}
+	}
+public:
+	uint32_t numWorkers() const
+	{
+		return uint32_t(m_workers.size());
+	}
+	uint32_t numThreads() const
+	{
+		return numWorkers() + 1;
+	}
+	uint32_t numNodes() const
+	{
+		return uint32_t(m_nodeWorkerCounts.size());
+	}
+	uint32_t workerNode(uint32_t worker) const
+	{
+		return m_workers[worker]->node;
+	}
+	uint32_t workerNodeRank(uint32_t worker) const
+	{
+		return m_workers[worker]->nodeRank;
+	}
+	uint32_t nodeWorkerCount(uint32_t node) const
+	{
+		return m_nodeWorkerCounts[node];
+	}
+	//node of the calling worker, 0 for threads outside the pool
+	uint32_t currentNode() const
+	{
+		uint32_t self = currentWorker();
+		return self < numWorkers() ? workerNode(self) : 0;
+	}
+	//splits [0, count) into contiguous chunks and calls fn(begin, end, threadIndex), threadIndex < numThreads().
+	//chunk i always lands on the same worker first, so data first-touched by a chunk stays local unless the chunk is stolen
+	void parallelFor(uint32_t count, const std::function<void(uint32_t, uint32_t, uint32_t)>& fn, uint32_t minPerTask = 1)
+	{
+		uint32_t self = currentWorker();
+		uint32_t maxTasks = (count + std::max(1u, minPerTask) - 1) / std::max(1u, minPerTask);
+		uint32_t numTasks = std::min(maxTasks, numThreads() * 4);
+		if (numTasks <= 1 || numWorkers() == 0)
+		{
+			if (count > 0)
+			{
+				fn(0, count, self);
+			}
+			return;
+		}
+		std::atomic<uint32_t> remaining(numTasks);
+		for (uint32_t t = 0; t < numTasks; ++t)
+		{
+			uint32_t begin = uint64_t(count) * t / numTasks;
+			uint32_t end = uint64_t(count) * (t + 1) / numTasks;
+			push(t % numWorkers(), [&fn, &remaining, begin, end](uint32_t thread)
+			{
+				fn(begin, end, thread);
+				remaining.fetch_sub(1, std::memory_order_release);
+			}, false);
+		}
+		wait(remaining, self);
+	}
+	//runs fn(worker) exactly once on every worker; these tasks are never stolen, which is what first-touch placement needs
+	void forEachWorker(const std::function<void(uint32_t)>& fn)
+	{
+		std::atomic<uint32_t> remaining(numWorkers());
+		for (uint32_t w = 0; w < numWorkers(); ++w)
+		{
+			push(w, [&fn, &remaining](uint32_t thread)
+			{
+				fn(thread);
+				remaining.fetch_sub(1, std::memory_order_release);
+			}, true);
+		}
+		wait(remaining, currentWorker());
+	}
+public:
+	//MNIST_THREADS and MNIST_AFFINITY (none, compact, scatter) configure the shared pool, which is unpinned unless asked otherwise
+	static ThreadPool& GetInstance()
+	{
+		static ThreadPool s_instance(EnvThreads(), EnvAffinity());
+		return s_instance;
+	}
+	//MNIST_THREADS, or 0 (one thread per allowed cpu) when unset, for pools sized like the shared one without creating it
+	static uint32_t EnvThreads()
+	{
+		const char* value = std::getenv("MNIST_THREADS");
+		return value ? uint32_t(std::strtoul(value, nullptr, 10)) : 0;
+	}
+private:
+	struct Task
+	{
+		std::function<void(uint32_t)> fn;
+		bool pinned;
+	};
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::deque<Task> tasks;
+		uint32_t node;
+		uint32_t nodeRank;
+	};
+private:
+	uint32_t currentWorker() const
+	{
+		return CurrentPool() == this ? CurrentWorker() : numWorkers();
+	}
+	//m_queued is raised before the task becomes visible, so a thief can never decrement it below zero
+	void push(uint32_t worker, std::function<void(uint32_t)>&& fn, bool pinned)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_sleepMutex);
+			++m_queued;
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_workers[worker]->mutex);
+			m_workers[worker]->tasks.push_back(Task{ std::move(fn), pinned });
+		}
+		m_wakeUp.notify_all();
+	}
+	//pops the newest task of the own deque, else steals the oldest unpinned task of another worker
+	bool runOne(uint32_t self)
+	{
+		Task task;
+		bool found = false;
+		if (self < numWorkers())
+		{
+			Worker& worker = *m_workers[self];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			if (!worker.tasks.empty())
+			{
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+				found = true;
+			}
+		}
+		for (uint32_t i = 1; !found && i <= numWorkers(); ++i)
+		{
+			Worker& victim = *m_workers[(self + i) % numWorkers()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			for (auto it = victim.tasks.begin(); it != victim.tasks.end(); ++it)
+			{
+				if (!it->pinned)
+				{
+					task = std::move(*it);
+					victim.tasks.erase(it);
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!found)
+		{
+			return false;
+		}
+		m_queued.fetch_sub(1);
+		task.fn(self);
+		return true;
+	}
+	void wait(std::atomic<uint32_t>& remaining, uint32_t self)
+	{
+		while (remaining.load(std::memory_order_acquire) != 0)
+		{
+			if (!runOne(self))
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+	void workerLoop(uint32_t self)
+	{
+		CurrentPool() = this;
+		CurrentWorker() = self;
+		while (true)
+		{
+			if (runOne(self))
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			if (m_stop && m_queued.load() == 0)
+			{
+				return;
+			}
+			if (m_queued.load() == 0)
+			{
+				m_wakeUp.wait(lock);
+			}
+			else
+			{
+				//the queued tasks are pinned to other workers
+				lock.unlock();
+				std::this_thread::yield();
+			}
+		}
+	}
+	static ThreadPool*& CurrentPool()
+	{
+		static thread_local ThreadPool* s_pool = nullptr;
+		return s_pool;
+	}
+	static uint32_t& CurrentWorker()
+	{
+		static thread_local uint32_t s_worker = 0;
+		return s_worker;
+	}
+	static uint32_t TotalCpus(const NumaTopology& topology)
+	{
+		uint32_t count = 0;
+		for (const auto& cpus : topology.nodeCpus)
+		{
+			count += uint32_t(cpus.size());
+		}
+		return count;
+	}
+	static bool PinThread(std::thread& thread, uint32_t cpu)
+	{
+#ifdef _WIN32
+		return SetThreadAffinityMask(thread.native_handle(), DWORD_PTR(1) << cpu) != 0;
+#else
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(cpu, &cpuSet);
+		return pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet), &cpuSet) == 0;
+#endif
+	}
+	static AffinityPolicy EnvAffinity()
+	{
+		const char* value = std::getenv("MNIST_AFFINITY");
+		std::string policy = value ? value : "";
+		if (policy == "compact")
+		{
+			return AffinityPolicy::Compact;
+		}
+		if (policy == "scatter")
+		{
+			return AffinityPolicy::Scatter;
+		}
+		return AffinityPolicy::None;
+	}
+private:
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	std::vector<uint32_t> m_nodeWorkerCounts;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wakeUp;
+	std::atomic<uint32_t> m_queued;
+	bool m_stop;
+};
+
+//pages come straight from the os and are not touched here, so they land on the node of the first thread writing them
+inline void* AllocatePages(size_t bytes)
+{
+#ifdef _WIN32
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* pages = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return pages == MAP_FAILED ? nullptr : pages;
+#endif
+}
+
+inline void FreePages(void* pages, size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(pages, 0, MEM_RELEASE);
+#else
+	munmap(pages, bytes);
+#endif
+}
+
+enum class NumaPlacement
+{
+	Local,//one copy on the node of the thread calling assign
+	Interleave,//one copy, split across the workers so each part lives on its worker's node
+	Replicate,//one full copy per node
+};
+
+//read-mostly buffer (dataset, model replica) placed over the numa nodes by first-touch from the pool's pinned workers
+template<typename T>
+class NumaBuffer
+{
+public:
+	NumaBuffer(NumaPlacement placement = NumaPlacement::Interleave, ThreadPool& pool = ThreadPool::GetInstance()) :
+		m_placement(placement),
+		m_pool(pool),
+		m_count(0)
+	{}
+	~NumaBuffer()
+	{
+		release();
+	}
+	NumaBuffer(const NumaBuffer&) = delete;
+	NumaBuffer& operator=(const NumaBuffer&) = delete;
+public:
+	void assign(const T* data, size_t count)
+	{
+		release();
+		m_count = count;
+		uint32_t numCopies = m_placement == NumaPlacement::Replicate ? m_pool.numNodes() : 1;
+		for (uint32_t node = 0; node < numCopies; ++node)
+		{
+			m_copies.push_back((T*)AllocatePages(std::max<size_t>(1, count * sizeof(T))));
+		}
+		if (m_placement == NumaPlacement::Local || m_pool.numWorkers() == 0)
+		{
+			for (T* copy : m_copies)
+			{
+				memcpy(copy, data, count * sizeof(T));
+			}
+			return;
+		}
+		m_pool.forEachWorker([&](uint32_t worker)
+		{
+			size_t begin, end;
+			T* copy;
+			if (m_placement == NumaPlacement::Replicate)
+			{
+				uint32_t node = m_pool.workerNode(worker);
+				uint32_t rank = m_pool.workerNodeRank(worker);
+				uint32_t numRanks = m_pool.nodeWorkerCount(node);
+				begin = count * rank / numRanks;
+				end = count * (rank + 1) / numRanks;
+				copy = m_copies[node];
+			}
+			else
+			{
+				begin = count * worker / m_pool.numWorkers();
+				end = count * (worker + 1) / m_pool.numWorkers();
+				copy = m_copies[0];
+			}
+			memcpy(copy + begin, data + begin, (end - begin) * sizeof(T));
+		});
+		//nodes without a worker still need their replica
+		for (uint32_t node = 1; node < numCopies; ++node)
+		{
+			if (m_pool.nodeWorkerCount(node) == 0)
+			{
+				memcpy(m_copies[node], data, count * sizeof(T));
+			}
+		}
+	}
+	//zero-filled single copy for data the pool writes, such as model weights: the pages are first touched through
+	//parallelFor(numRows, ..., minPerTask), and a later parallelFor with the same arguments hands every chunk of rows to the
+	//same worker first, so unless a chunk is stolen its rows are local to the worker updating them
+	void allocateRows(uint32_t numRows, size_t rowSize, uint32_t minPerTask = 1)
+	{
+		release();
+		m_count = size_t(numRows) * rowSize;
+		m_copies.push_back((T*)AllocatePages(std::max<size_t>(1, m_count * sizeof(T))));
+		T* copy = m_copies[0];
+		m_pool.parallelFor(numRows, [&](uint32_t begin, uint32_t end, uint32_t)
+		{
+			std::fill(copy + size_t(begin) * rowSize, copy + size_t(end) * rowSize, T());
+		}, minPerTask);
+	}
+	size_t size() const
+	{
+		return m_count;
+	}
+	NumaPlacement placement() const
+	{
+		return m_placement;
+	}
+	const T* replica(uint32_t node) const
+	{
+		return m_copies[m_placement == NumaPlacement::Replicate ? node : 0];
+	}
+	//the copy closest to the calling thread
+	const T* data() const
+	{
+		return replica(m_pool.currentNode());
+	}
+	//writable access to the first copy, only meaningful for a single copy (allocateRows, Local or Interleave)
+	T* writableData()
+	{
+		return m_copies[0];
+	}
+private:
+	void release()
+	{
+		for (T* copy : m_copies)
+		{
+			FreePages(copy, std::max<size_t>(1, m_count * sizeof(T)));
+		}
+		m_copies.clear();
+		m_count = 0;
+	}
+private:
+	NumaPlacement m_placement;
+	ThreadPool& m_pool;
+	size_t m_count;
+	std::vector<T*> m_copies;
+};
+
+struct NumaBandwidth
+{
+	uint32_t numWorkers;
+	double localGBps;//workers of the node reading their own node's replica
+	double remoteGBps;//the same workers reading the next node's replica
+};
+
+//streams bytesPerNode through the workers of every node, once from local memory and once from the next node
+inline std::vector<NumaBandwidth> MeasureNumaBandwidth(ThreadPool& pool = ThreadPool::GetInstance(), size_t bytesPerNode = 256 << 20, uint32_t repeat = 4)
+{
+	size_t count = bytesPerNode / sizeof(uint64_t);
+	std::vector<uint64_t> source(count, 1);
+	NumaBuffer<uint64_t> buffer(NumaPlacement::Replicate, pool);
+	buffer.assign(source.data(), count);
+	std::vector<NumaBandwidth> bandwidths(pool.numNodes());
+	std::atomic<uint64_t> sink(0);//keeps the reads alive
+	auto read = [&](const uint64_t* data, size_t begin, size_t end)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint64_t sum = 0;
+		for (uint32_t r = 0; r < repeat; ++r)
+		{
+			for (size_t i = begin; i < end; ++i)
+			{
+				sum += data[i];
+			}
+		}
+		sink.fetch_add(sum, std::memory_order_relaxed);
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	if (pool.numWorkers() == 0)
+	{
+		double seconds = read(buffer.replica(0), 0, count);
+		bandwidths[0].numWorkers = 0;
+		bandwidths[0].localGBps = bandwidths[0].remoteGBps = double(bytesPerNode) * repeat / seconds / 1e9;
+		return bandwidths;
+	}
+	for (uint32_t remote = 0; remote < 2; ++remote)
+	{
+		std::vector<double> seconds(pool.numWorkers());
+		pool.forEachWorker([&](uint32_t worker)
+		{
+			uint32_t node = pool.workerNode(worker);
+			uint32_t rank = pool.workerNodeRank(worker);
+			uint32_t numRanks = pool.nodeWorkerCount(node);
+			size_t begin = count * rank / numRanks;
+			size_t end = count * (rank + 1) / numRanks;
+			seconds[worker] = read(buffer.replica((node + remote) % pool.numNodes()), begin, end);
+		});
+		for (uint32_t node = 0; node < pool.numNodes(); ++node)
+		{
+			double slowest = 0;
+			for (uint32_t w = 0; w < pool.numWorkers(); ++w)
+			{
+				if (pool.workerNode(w) == node)
+				{
+					slowest = std::max(slowest, seconds[w]);
+				}
+			}
+			double gbps = slowest > 0 ? double(bytesPerNode) * repeat / slowest / 1e9 : 0;
+			bandwidths[node].numWorkers = pool.nodeWorkerCount(node);
+			(remote ? bandwidths[node].remoteGBps : bandwidths[node].localGBps) = gbps;
+		}
+	}
+	return bandwidths;
+}
+
+inline void PrintNumaBandwidth(const std::vector<NumaBandwidth>& bandwidths)
+{
+	for (uint32_t node = 0; node < bandwidths.size(); ++node)
+	{
+		printf("node %u: %u workers, local %.2f GB/s, remote %.2f GB/s\n", node,
+			bandwidths[node].numWorkers, bandwidths[node].localGBps, bandwidths[node].remoteGBps);
+	}
+}